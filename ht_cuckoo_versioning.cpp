@@ -0,0 +1,365 @@
+#include "ht_cuckoo_versioning.h"
+#include "ht_file_versioning.h"
+
+#include <vector>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <new>
+
+const uint8_t HTCuckooFileVersioning::slots;
+const uint8_t HTCuckooFileVersioning::minFingerprintBits;
+const uint8_t HTCuckooFileVersioning::maxFingerprintBits;
+const unsigned HTCuckooFileVersioning::maxKicks;
+const uint64_t HTCuckooFileVersioning::lineBitsLen;
+
+/// Load the tables are sized for, 4 slots buckets fill up to ~98%.
+static const double maxLoad = 0.95;
+
+HTCuckooFileVersioning::HTCuckooFileVersioning(void):
+    table(NULL), buckets(0), fpBits(0), layout(HTFileVersioning::LAYOUT_FLAT),
+    lineBuckets(0), items(0), kick(0)
+{
+    this->configure(64, maxFingerprintBits, HTFileVersioning::LAYOUT_FLAT);
+}
+
+HTCuckooFileVersioning::HTCuckooFileVersioning(uint64_t expected_items,
+    double fpr, HTFileVersioning::Layout layout):
+    table(NULL), buckets(0), fpBits(0), layout(HTFileVersioning::LAYOUT_FLAT),
+    lineBuckets(0), items(0), kick(0)
+{
+    if (!expected_items || !(fpr > 0.0) || !(fpr < 1.0))
+        throw "Bad cuckoo parameters";
+
+    // A miss is matched against the 2*slots slots of its buckets, each one
+    // with a chance of 1/2^f
+    double f = ceil(log2(2*slots/fpr));
+    if (f < minFingerprintBits) f = minFingerprintBits;
+    if (f > maxFingerprintBits) f = maxFingerprintBits;
+
+    // The same buckets per line may fit wider fingerprints, for free
+    if (layout == HTFileVersioning::LAYOUT_BLOCKED) {
+        unsigned line_buckets = lineBitsLen/(slots*unsigned(f));
+        f = lineBitsLen/(slots*line_buckets);
+        if (f > maxFingerprintBits) f = maxFingerprintBits;
+    }
+
+    double buckets = ceil(double(expected_items)/(slots*maxLoad));
+    if (buckets*slots*f > double(HTFileVersioning::maxBitsLen))
+        throw "Bad cuckoo parameters";
+    this->configure(uint64_t(buckets), uint8_t(f), layout);
+}
+
+HTCuckooFileVersioning::~HTCuckooFileVersioning()
+{
+    free(this->table);
+}
+
+void HTCuckooFileVersioning::configure(uint64_t buckets, uint8_t fp_bits,
+    HTFileVersioning::Layout layout)
+{
+    if (!buckets || fp_bits < minFingerprintBits ||
+        fp_bits > maxFingerprintBits ||
+        layout > HTFileVersioning::LAYOUT_BLOCKED ||
+        buckets*slots*fp_bits > HTFileVersioning::maxBitsLen)
+        throw "Bad table geometry";
+
+    uint8_t line_buckets = lineBitsLen/(slots*fp_bits);
+    uint64_t bits = buckets*slots*fp_bits;
+    if (layout == HTFileVersioning::LAYOUT_BLOCKED)
+        bits = buckets/line_buckets*lineBitsLen +
+            buckets%line_buckets*slots*fp_bits;
+    if (bits > HTFileVersioning::maxBitsLen)
+        throw "Bad table geometry";
+
+    void *table = NULL;
+    // 8 bytes of slack, the last bucket is read with a whole 8 bytes load
+    size_t len = ((bits+7)/8 + 8 + 63)/64*64;
+    if (posix_memalign(&table, 64, len))
+        throw std::bad_alloc();
+    bzero(table, len);
+
+    free(this->table);
+    this->table = (uint8_t*)table;
+    this->buckets = buckets;
+    this->fpBits = fp_bits;
+    this->layout = layout;
+    this->lineBuckets = line_buckets;
+    this->items = 0;
+    this->kick = 0x9E3779B97F4A7C15ULL;
+}
+
+double HTCuckooFileVersioning::loadFactor(void) const
+{
+    return double(this->items)/(this->buckets*slots);
+}
+
+double HTCuckooFileVersioning::estimatedFpr(void) const
+{
+    // Fingerprints are never 0, 2^f-1 values
+    double match = 1.0/((1<<this->fpBits)-1);
+    return 1 - pow(1 - match, 2*slots*this->loadFactor());
+}
+
+void HTCuckooFileVersioning::reset(void)
+{
+    bzero(this->table, this->getHTableBytesLen());
+    this->items = 0;
+}
+
+void HTCuckooFileVersioning::fingerprint(const char *fname, uint64_t *index,
+    uint32_t *fp) const
+{
+    uint32_t hash[4];
+    uint64_t h1, h2;
+
+    HTFileVersioning::hashFile(fname, hash);
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+
+    (*index) = h1%this->buckets;
+    (*fp) = uint32_t((h2>>1)%((1<<this->fpBits)-1)) + 1;
+}
+
+uint64_t HTCuckooFileVersioning::altIndex(uint64_t index, uint32_t fp) const
+{
+    uint64_t h = (uint64_t(fp)*0xc4ceb9fe1a85ec53ULL)>>16;
+    h %= this->buckets;
+    return h >= index ? h-index : h+this->buckets-index;
+}
+
+uint64_t HTCuckooFileVersioning::getBucketBit(uint64_t index) const
+{
+    if (this->layout == HTFileVersioning::LAYOUT_BLOCKED)
+        return index/this->lineBuckets*lineBitsLen +
+            index%this->lineBuckets*slots*this->fpBits;
+    return index*slots*this->fpBits;
+}
+
+/// \brief Returns the byte the 8 bytes load of a bucket starts at.
+///
+/// Buckets start at multiples of 4 bits, so 4f+4 <= 64 bits always fit in
+/// the load. A bucket at the end of a line is read from the last 8 bytes of
+/// the line instead, so the load never leaves the line of a blocked bucket.
+///
+/// \param bit first bit of the bucket.
+/// \param layout how the buckets are laid out.
+static uint64_t bucketLoad(uint64_t bit, HTFileVersioning::Layout layout)
+{
+    const uint64_t line = HTCuckooFileVersioning::lineBitsLen/8;
+    uint64_t byte = bit>>3;
+
+    if (layout == HTFileVersioning::LAYOUT_BLOCKED && byte%line > line-8)
+        byte = byte/line*line + line-8;
+    return byte;
+}
+
+uint64_t HTCuckooFileVersioning::getBucket(uint64_t index) const
+{
+    uint64_t bit = this->getBucketBit(index);
+    uint64_t byte = bucketLoad(bit, this->layout);
+    uint64_t word;
+    uint8_t width = slots*this->fpBits;
+
+    memcpy(&word, this->table + byte, 8);
+    word >>= bit - byte*8;
+    if (width < 64)
+        word &= (uint64_t(1)<<width)-1;
+    return word;
+}
+
+void HTCuckooFileVersioning::setBucket(uint64_t index, uint64_t bucket)
+{
+    uint64_t bit = this->getBucketBit(index);
+    uint64_t byte = bucketLoad(bit, this->layout);
+    uint64_t word, mask = ~uint64_t(0);
+    uint8_t width = slots*this->fpBits;
+
+    if (width < 64)
+        mask = (uint64_t(1)<<width)-1;
+    memcpy(&word, this->table + byte, 8);
+    word &= ~(mask<<(bit - byte*8));
+    word |= bucket<<(bit - byte*8);
+    memcpy(this->table + byte, &word, 8);
+}
+
+bool HTCuckooFileVersioning::matchBucket(uint64_t bucket, uint32_t fp) const
+{
+    // SWAR zero lane test over the f bits slots: no slot borrows unless a
+    // slot below is zero, so the test is exact
+    uint8_t f = this->fpBits;
+    uint64_t low = 1 | uint64_t(1)<<f | uint64_t(1)<<(2*f) |
+        uint64_t(1)<<(3*f);
+    uint64_t high = low<<(f-1);
+    uint64_t x = bucket ^ (low*fp);
+
+    return ((x - low) & ~x & high) != 0;
+}
+
+int HTCuckooFileVersioning::findSlot(uint64_t bucket, uint32_t fp) const
+{
+    uint32_t mask = (1<<this->fpBits)-1;
+
+    for (int s=0; s<slots; ++s)
+        if (((bucket>>(s*this->fpBits))&mask) == fp)
+            return s;
+    return -1;
+}
+
+bool HTCuckooFileVersioning::insertSlot(uint64_t index, uint32_t fp)
+{
+    uint64_t bucket = this->getBucket(index);
+    int s = this->findSlot(bucket, 0);
+
+    if (s < 0)
+        return false;
+    this->setBucket(index, bucket | uint64_t(fp)<<(s*this->fpBits));
+    return true;
+}
+
+bool HTCuckooFileVersioning::addFile(const char *fname)
+{
+    uint64_t i1;
+    uint32_t fp;
+
+    this->fingerprint(fname, &i1, &fp);
+    uint64_t i2 = this->altIndex(i1, fp);
+    if (this->insertSlot(i1, fp) || this->insertSlot(i2, fp)) {
+        ++this->items;
+        return true;
+    }
+
+    // Both buckets are full, move fingerprints to their other bucket and
+    // log the moves, so a failed insert can be undone
+    struct Move {
+        uint64_t index;
+        uint64_t bucket;
+    };
+    std::vector<Move> moves;
+    moves.reserve(maxKicks);
+
+    uint32_t mask = (1<<this->fpBits)-1;
+    uint64_t index = (this->kick & 1) ? i1 : i2;
+    for (unsigned k=0; k<maxKicks; ++k) {
+        // xorshift64
+        this->kick ^= this->kick<<13;
+        this->kick ^= this->kick>>7;
+        this->kick ^= this->kick<<17;
+
+        uint64_t bucket = this->getBucket(index);
+        unsigned shift = (this->kick%slots)*this->fpBits;
+        Move move = {index, bucket};
+        moves.push_back(move);
+
+        uint32_t victim = (bucket>>shift)&mask;
+        bucket &= ~(uint64_t(mask)<<shift);
+        this->setBucket(index, bucket | uint64_t(fp)<<shift);
+
+        fp = victim;
+        index = this->altIndex(index, fp);
+        if (this->insertSlot(index, fp)) {
+            ++this->items;
+            return true;
+        }
+    }
+
+    for (size_t m=moves.size(); m>0; --m)
+        this->setBucket(moves[m-1].index, moves[m-1].bucket);
+    return false;
+}
+
+bool HTCuckooFileVersioning::checkFile(const char *fname) const
+{
+    uint64_t i1;
+    uint32_t fp;
+
+    this->fingerprint(fname, &i1, &fp);
+    uint64_t b1 = this->getBucket(i1);
+    uint64_t b2 = this->getBucket(this->altIndex(i1, fp));
+    return this->matchBucket(b1, fp) | this->matchBucket(b2, fp);
+}
+
+bool HTCuckooFileVersioning::removeFile(const char *fname)
+{
+    uint64_t index[2];
+    uint32_t fp;
+
+    this->fingerprint(fname, &index[0], &fp);
+    index[1] = this->altIndex(index[0], fp);
+
+    for (int i=0; i<2; ++i) {
+        uint64_t bucket = this->getBucket(index[i]);
+        int s = this->findSlot(bucket, fp);
+        if (s < 0)
+            continue;
+
+        uint32_t mask = (1<<this->fpBits)-1;
+        this->setBucket(index[i],
+            bucket & ~(uint64_t(mask)<<(s*this->fpBits)));
+        --this->items;
+        return true;
+    }
+    return false;
+}
+
+void HTCuckooFileVersioning::getRawHTable(void *place, size_t len) const
+{
+    size_t tam = getHTableBytesLen();
+    if (tam > len)
+        tam = len;
+    memcpy(place, this->table, tam);
+}
+
+std::string HTCuckooFileVersioning::getHTable(void) const
+{
+    return HTFileVersioning::encodeHTable(this->table,
+        this->getHTableBytesLen(), this->fpBits, this->getHTableBitsLen(),
+        this->layout, HTFileVersioning::kindCuckoo);
+}
+
+void HTCuckooFileVersioning::setHTable(std::string str)
+{
+    uint8_t fp_bits, kind;
+    uint64_t bits;
+    HTFileVersioning::Layout layout;
+    std::vector<uint8_t> raw;
+
+    HTFileVersioning::decodeHTable(str, raw, &fp_bits, &bits, &layout, &kind);
+    if (kind != HTFileVersioning::kindCuckoo)
+        throw "Not a cuckoo table";
+    if (fp_bits < minFingerprintBits || fp_bits > maxFingerprintBits)
+        throw "Bad table header";
+
+    uint64_t width = slots*fp_bits, buckets = bits/width;
+    if (layout == HTFileVersioning::LAYOUT_BLOCKED) {
+        uint64_t line_buckets = lineBitsLen/width, last = bits%lineBitsLen;
+        if (last%width || last/width >= line_buckets)
+            throw "Bad table header";
+        buckets = bits/lineBitsLen*line_buckets + last/width;
+    } else if (bits%width)
+        throw "Bad table header";
+
+    this->configure(buckets, fp_bits, layout);
+    memcpy(this->table, &raw[0], raw.size());
+
+    // Nothing reads the unused tails of the lines, clear them so they are
+    // not exported again
+    uint64_t used = this->lineBuckets*width;
+    if (layout == HTFileVersioning::LAYOUT_BLOCKED && used < lineBitsLen) {
+        for (uint64_t line=0; line*lineBitsLen < bits; ++line) {
+            uint8_t *p = this->table + line*(lineBitsLen/8);
+            p[used/8] &= (1<<(used%8))-1;
+            bzero(p + used/8 + 1, lineBitsLen/8 - used/8 - 1);
+        }
+    }
+    if (bits%8)
+        this->table[bits/8] &= (1<<(bits%8))-1;
+
+    for (uint64_t b=0; b<this->buckets; ++b) {
+        uint64_t bucket = this->getBucket(b);
+        for (int s=0; s<slots; ++s)
+            if ((bucket>>(s*fp_bits)) & ((1<<fp_bits)-1))
+                ++this->items;
+    }
+}
@@ -0,0 +1,257 @@
+#ifndef __HT_CUCKOO_VERSIONING_H__
+#define __HT_CUCKOO_VERSIONING_H__
+
+#include <string>
+#include <stdint.h>
+
+#include "ht_file_versioning.h"
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief Cuckoo filter for file versioning.
+///
+/// Same add, check, reset and export interface of HTFileVersioning, backed by
+/// a cuckoo filter: each file keeps a fingerprint of 8 to 16 bits in one of
+/// its two candidate buckets of 4 slots. At low false positive rates it takes
+/// fewer bits per file than a Bloom table and files can be removed.
+///
+/// The buckets are packed back to back, a bucket is read with a single 8
+/// bytes load and all its slots are matched at once. With LAYOUT_BLOCKED a
+/// 64 bytes line only holds whole buckets, so a check touches two lines at
+/// most.
+////////////////////////////////////////////////////////////////////////////////
+class HTCuckooFileVersioning {
+    public:
+        static const uint8_t slots = 4;                ///< Slots per bucket
+        static const uint8_t minFingerprintBits = 8;   ///< Min fingerprint size
+        static const uint8_t maxFingerprintBits = 16;  ///< Max fingerprint size
+        static const unsigned maxKicks = 500; ///< Relocations before giving up
+        static const uint64_t lineBitsLen = 512;       ///< Bits per line
+
+        /// \brief Default constructor.
+        ///
+        /// 64 buckets of 16 bits fingerprints, the 4096 bits of a legacy
+        /// HTFileVersioning.
+        HTCuckooFileVersioning(void);
+
+        /// \brief Cuckoo filter sized for a false positive rate.
+        ///
+        /// Picks the fingerprint size for fpr and enough buckets to hold
+        /// expected_items at 95% load. LAYOUT_BLOCKED leaves the tail of each
+        /// line unused and widens the fingerprints into it when they fit.
+        ///
+        /// \param expected_items number of files expected on the table.
+        /// \param fpr target false positive rate, in (0, 1).
+        /// \param layout LAYOUT_FLAT to pack buckets across lines,
+        /// LAYOUT_BLOCKED to keep each bucket inside a 64 bytes line.
+        HTCuckooFileVersioning(uint64_t expected_items, double fpr,
+            HTFileVersioning::Layout layout=HTFileVersioning::LAYOUT_FLAT);
+        ~HTCuckooFileVersioning();
+
+        /// \brief Returns the size of the table.
+        ///
+        /// \return number of bits of the table, unused line tails included.
+        uint64_t getHTableBitsLen(void) const
+        {
+            if (this->layout == HTFileVersioning::LAYOUT_BLOCKED)
+                return this->buckets/this->lineBuckets*lineBitsLen +
+                    this->buckets%this->lineBuckets*slots*this->fpBits;
+            return this->buckets*slots*this->fpBits;
+        }
+
+        /// \brief Returns the size of the table.
+        ///
+        /// \return number of bytes of the table.
+        uint64_t getHTableBytesLen(void) const
+        {
+            return (getHTableBitsLen()+7)/8;
+        }
+
+        /// \brief Returns the number of buckets.
+        uint64_t getBuckets(void) const
+        {
+            return this->buckets;
+        }
+
+        /// \brief Returns the size in bits of the fingerprints.
+        uint8_t getFingerprintBits(void) const
+        {
+            return this->fpBits;
+        }
+
+        /// \brief Returns how the buckets are laid out.
+        HTFileVersioning::Layout getLayout(void) const
+        {
+            return this->layout;
+        }
+
+        /// \brief Returns where a bucket starts.
+        ///
+        /// \param index the bucket.
+        /// \return the bit of the raw table holding slot 0 of the bucket.
+        uint64_t getBucketBit(uint64_t index) const;
+
+        /// \brief Returns the number of files on the table.
+        uint64_t getItems(void) const
+        {
+            return this->items;
+        }
+
+        /// \brief Returns how full the table is.
+        ///
+        /// \return the fraction of the slots in use.
+        double loadFactor(void) const;
+
+        /// \brief Estimates the false positive rate.
+        ///
+        /// \return the chance of checkFile returning true for a file never
+        /// added, at the current load.
+        double estimatedFpr(void) const;
+
+        /// \brief Reset the table.
+        ///
+        /// Empty all slots, effectively marking all files as non existent on
+        /// the table.
+        void reset(void);
+
+        /// \brief Add a file.
+        ///
+        /// \param fname null terminated std string.
+        /// \return false if the table is full, the file was not added.
+        bool addFile(const std::string &fname)
+            { return this->addFile(fname.c_str()); }
+
+        /// \brief Add a file.
+        ///
+        /// Store the fingerprint of the file in one of its buckets, moving
+        /// other fingerprints to their alternate bucket when both are full.
+        /// A file added twice takes two slots.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return false if the table is full, the file was not added and
+        /// the table is left as it was.
+        bool addFile(const char *fname);
+
+        /// \brief Check a file.
+        ///
+        /// \param fname null terminated std string.
+        /// \return true if present, false otherwise.
+        bool checkFile(const std::string &fname) const
+            { return this->checkFile(fname.c_str()); }
+
+        /// \brief Check a file.
+        ///
+        /// Match the fingerprint of the file against both of its buckets.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return true if present, false otherwise.
+        bool checkFile(const char *fname) const;
+
+        /// \brief Remove a file.
+        ///
+        /// \param fname null terminated std string.
+        /// \return true if the file was present, false otherwise.
+        bool removeFile(const std::string &fname)
+            { return this->removeFile(fname.c_str()); }
+
+        /// \brief Remove a file.
+        ///
+        /// Remove one copy of the fingerprint of the file. Removing a file
+        /// never added may remove another file with the same fingerprint.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return true if the file was present, false otherwise.
+        bool removeFile(const char *fname);
+
+        /// \brief Copy the raw table.
+        ///
+        /// Copy the raw table to *place respecting its size of len.
+        ///
+        /// \param place pointer to buffer where to copy to.
+        /// \param len size of destination buffer.
+        void getRawHTable(void *place, size_t len) const;
+
+        /// \brief Returns the compressed table.
+        ///
+        /// \return std string with table compressed and encoded.
+        std::string getHTable(void) const;
+
+        /// \brief Set the table.
+        ///
+        /// Decode and decompress a table exported by getHTable, than set it
+        /// as current table. The number of buckets, the fingerprint size and
+        /// the layout are adopted by this table.
+        ///
+        /// \param str Compressed and B64 encoded table
+        void setHTable(std::string str);
+
+    protected:
+        uint8_t *table;   ///< Packed buckets, padded for 8 bytes loads
+        uint64_t buckets; ///< Number of buckets
+        uint8_t fpBits;   ///< Size in bits of the fingerprints
+        HTFileVersioning::Layout layout; ///< Buckets across lines or not
+        uint8_t lineBuckets; ///< Buckets per line, with LAYOUT_BLOCKED
+        uint64_t items;   ///< Slots in use
+        uint64_t kick;    ///< State of the relocations random generator
+
+        /// \brief Sets the table geometry.
+        ///
+        /// Validates the geometry, reallocates the table and clears it.
+        ///
+        /// \param buckets number of buckets.
+        /// \param fp_bits size in bits of the fingerprints.
+        /// \param layout how the buckets are laid out.
+        void configure(uint64_t buckets, uint8_t fp_bits,
+            HTFileVersioning::Layout layout);
+
+        /// \brief Hash a file.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \param index where to store the first bucket of the file.
+        /// \param fp where to store the fingerprint of the file, never 0.
+        void fingerprint(const char *fname, uint64_t *index,
+            uint32_t *fp) const;
+
+        /// \brief Returns the other bucket of a fingerprint.
+        ///
+        /// (H(fp) - index) mod buckets, applied twice gives index back.
+        ///
+        /// \param index one of the buckets of the fingerprint.
+        /// \param fp the fingerprint.
+        /// \return the other bucket.
+        uint64_t altIndex(uint64_t index, uint32_t fp) const;
+
+        /// \brief Reads a bucket.
+        ///
+        /// \param index the bucket.
+        /// \return the slots of the bucket, slot 0 on the low bits.
+        uint64_t getBucket(uint64_t index) const;
+
+        /// \brief Writes a bucket.
+        ///
+        /// \param index the bucket.
+        /// \param bucket the slots of the bucket, slot 0 on the low bits.
+        void setBucket(uint64_t index, uint64_t bucket);
+
+        /// \brief Matches all slots of a bucket.
+        ///
+        /// \param bucket the slots of the bucket.
+        /// \param fp the fingerprint to look for, 0 for an empty slot.
+        /// \return true if any slot holds fp.
+        bool matchBucket(uint64_t bucket, uint32_t fp) const;
+
+        /// \brief Finds a slot.
+        ///
+        /// \param bucket the slots of the bucket.
+        /// \param fp the fingerprint to look for, 0 for an empty slot.
+        /// \return the first slot holding fp, -1 if none.
+        int findSlot(uint64_t bucket, uint32_t fp) const;
+
+        /// \brief Stores a fingerprint on an empty slot of a bucket.
+        ///
+        /// \param index the bucket.
+        /// \param fp the fingerprint.
+        /// \return false if the bucket is full.
+        bool insertSlot(uint64_t index, uint32_t fp);
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "ht_exact_versioning.h"
+#include "ht_file_versioning.h"
+#include "ht_kernels.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+const uint8_t HTExactFileVersioning::groupLen;
+const uint64_t HTExactFileVersioning::minSlots;
+const uint8_t HTExactFileVersioning::ctrlEmpty;
+
+HTExactFileVersioning::HTExactFileVersioning(void):
+    ctrl(NULL), keys(NULL), slots(0), items(0)
+{
+    this->configure(minSlots);
+}
+
+HTExactFileVersioning::HTExactFileVersioning(uint64_t expected_items):
+    ctrl(NULL), keys(NULL), slots(0), items(0)
+{
+    uint64_t slots = minSlots;
+    while (slots/8*7 < expected_items)
+        slots <<= 1;
+    this->configure(slots);
+}
+
+HTExactFileVersioning::~HTExactFileVersioning()
+{
+    free(this->ctrl);
+    free(this->keys);
+}
+
+void HTExactFileVersioning::configure(uint64_t slots)
+{
+    void *ctrl = NULL, *keys = NULL;
+
+    if (posix_memalign(&ctrl, 64, slots))
+        throw std::bad_alloc();
+    if (posix_memalign(&keys, 64, slots*sizeof(uint64_t))) {
+        free(ctrl);
+        throw std::bad_alloc();
+    }
+    memset(ctrl, ctrlEmpty, slots);
+
+    free(this->ctrl);
+    free(this->keys);
+    this->ctrl = (uint8_t*)ctrl;
+    this->keys = (uint64_t*)keys;
+    this->slots = slots;
+    this->items = 0;
+}
+
+void HTExactFileVersioning::reset(void)
+{
+    memset(this->ctrl, ctrlEmpty, this->slots);
+    this->items = 0;
+}
+
+uint64_t HTExactFileVersioning::fingerprint(const char *fname)
+{
+    uint32_t hash[4];
+    uint64_t h1, h2;
+
+    HTFileVersioning::hashFile(fname, hash);
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+    return h1;
+}
+
+bool HTExactFileVersioning::checkKey(uint64_t key) const
+{
+    // The 7 low bits tag the slot, the others pick the first group. Groups
+    // are probed with triangular steps, that visit all of them
+    uint64_t groups = this->slots/groupLen;
+    uint64_t g = (key>>7) & (groups-1);
+    uint8_t tag = key & 0x7F;
+
+    for (uint64_t step=1; step<=groups; ++step) {
+        const uint8_t *group = this->ctrl + g*groupLen;
+
+        uint32_t match = HTKernels::groupMatch(group, tag);
+        while (match) {
+            int s = __builtin_ctz(match);
+            if (this->keys[g*groupLen + s] == key)
+                return true;
+            match &= match-1;
+        }
+        // Nothing is ever removed, an empty slot ends the chain
+        if (HTKernels::groupMatch(group, ctrlEmpty))
+            return false;
+        g = (g+step) & (groups-1);
+    }
+    return false;
+}
+
+void HTExactFileVersioning::insertKey(uint64_t key)
+{
+    uint64_t groups = this->slots/groupLen;
+    uint64_t g = (key>>7) & (groups-1);
+
+    for (uint64_t step=1; ; ++step) {
+        uint32_t empty = HTKernels::groupMatch(this->ctrl + g*groupLen,
+            ctrlEmpty);
+        if (empty) {
+            uint64_t slot = g*groupLen + __builtin_ctz(empty);
+            this->ctrl[slot] = key & 0x7F;
+            this->keys[slot] = key;
+            ++this->items;
+            return;
+        }
+        g = (g+step) & (groups-1);
+    }
+}
+
+void HTExactFileVersioning::grow(void)
+{
+    uint8_t *ctrl = this->ctrl;
+    uint64_t *keys = this->keys;
+    uint64_t slots = this->slots;
+
+    this->ctrl = NULL;
+    this->keys = NULL;
+    try {
+        this->configure(slots*2);
+    } catch (...) {
+        this->ctrl = ctrl;
+        this->keys = keys;
+        throw;
+    }
+
+    for (uint64_t s=0; s<slots; ++s)
+        if (ctrl[s] != ctrlEmpty)
+            this->insertKey(keys[s]);
+    free(ctrl);
+    free(keys);
+}
+
+void HTExactFileVersioning::addKey(uint64_t key)
+{
+    if (this->checkKey(key))
+        return;
+    if (this->items+1 > this->slots/8*7)
+        this->grow();
+    this->insertKey(key);
+}
+
+void HTExactFileVersioning::addFile(const char *fname)
+{
+    this->addKey(HTExactFileVersioning::fingerprint(fname));
+}
+
+bool HTExactFileVersioning::checkFile(const char *fname) const
+{
+    return this->checkKey(HTExactFileVersioning::fingerprint(fname));
+}
+
+std::string HTExactFileVersioning::getHTable(void) const
+{
+    std::vector<uint64_t> sorted;
+    sorted.reserve(this->items);
+    for (uint64_t s=0; s<this->slots; ++s)
+        if (this->ctrl[s] != ctrlEmpty)
+            sorted.push_back(this->keys[s]);
+    std::sort(sorted.begin(), sorted.end());
+
+    // Number of files ahead of the fingerprints, all little endian
+    std::vector<uint8_t> payload;
+    payload.reserve((sorted.size()+1)*8);
+    for (uint8_t b=0; b<64; b+=8)
+        payload.push_back(uint8_t(uint64_t(sorted.size())>>b));
+    for (size_t k=0; k<sorted.size(); ++k)
+        for (uint8_t b=0; b<64; b+=8)
+            payload.push_back(uint8_t(sorted[k]>>b));
+
+    return HTFileVersioning::encodeHTable(&payload[0], payload.size(), 1,
+        uint64_t(payload.size())*8, HTFileVersioning::LAYOUT_FLAT,
+        HTFileVersioning::kindExact);
+}
+
+/// Decodes an exported exact table to its fingerprints.
+static void decodeKeys(const std::string &str, std::vector<uint64_t> &keys)
+{
+    uint8_t probes, kind;
+    uint64_t bits;
+    HTFileVersioning::Layout layout;
+    std::vector<uint8_t> raw;
+
+    HTFileVersioning::decodeHTable(str, raw, &probes, &bits, &layout, &kind);
+    if (kind != HTFileVersioning::kindExact)
+        throw "Not an exact table";
+
+    // The key count, then the keys, 8 bytes each
+    if (raw.size() < 8 || raw.size()%8)
+        throw "Bad table header";
+    uint64_t count = 0;
+    for (uint8_t b=0; b<8; ++b)
+        count |= uint64_t(raw[b])<<(b*8);
+    if (count != raw.size()/8 - 1)
+        throw "Bad table header";
+
+    keys.resize(count);
+    for (uint64_t k=0; k<count; ++k) {
+        keys[k] = 0;
+        for (uint8_t b=0; b<8; ++b)
+            keys[k] |= uint64_t(raw[(k+1)*8+b])<<(b*8);
+    }
+}
+
+void HTExactFileVersioning::setHTable(std::string str)
+{
+    std::vector<uint64_t> keys;
+
+    decodeKeys(str, keys);
+
+    uint64_t slots = minSlots;
+    while (slots/8*7 < keys.size())
+        slots <<= 1;
+    this->configure(slots);
+    for (size_t k=0; k<keys.size(); ++k)
+        this->addKey(keys[k]);
+}
+
+void HTExactFileVersioning::mergeHTable(std::string str)
+{
+    std::vector<uint64_t> keys;
+
+    decodeKeys(str, keys);
+    for (size_t k=0; k<keys.size(); ++k)
+        this->addKey(keys[k]);
+}
+
+void HTExactFileVersioning::mergeHTable(const HTExactFileVersioning &table)
+{
+    for (uint64_t s=0; s<table.slots; ++s)
+        if (table.ctrl[s] != ctrlEmpty)
+            this->addKey(table.keys[s]);
+}
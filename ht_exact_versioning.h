@@ -0,0 +1,152 @@
+#ifndef __HT_EXACT_VERSIONING_H__
+#define __HT_EXACT_VERSIONING_H__
+
+#include <string>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief Exact set for file versioning.
+///
+/// Same add, check, merge and export interface of HTFileVersioning, without
+/// false positives: keeps a 64b fingerprint of each file (about 8 bytes per
+/// file) in an open addressing table. Slots are probed in groups of 16, the
+/// 7 low bits of each fingerprint live in a control byte per slot and a
+/// whole group of control bytes is matched with a single SSE2 compare.
+///
+/// Two files are only mistaken when their 64b fingerprints collide.
+////////////////////////////////////////////////////////////////////////////////
+class HTExactFileVersioning {
+    public:
+        static const uint8_t groupLen = 16;   ///< Slots per group
+        static const uint64_t minSlots = 16;  ///< Smallest table
+
+        HTExactFileVersioning(void);
+
+        /// \brief Table sized for a number of files.
+        ///
+        /// \param expected_items files the table holds without growing.
+        explicit HTExactFileVersioning(uint64_t expected_items);
+        ~HTExactFileVersioning();
+
+        /// \brief Returns the memory used by the table.
+        ///
+        /// \return number of bytes of the slots and control bytes.
+        uint64_t getHTableBytesLen(void) const
+        {
+            return this->slots*(sizeof(uint64_t)+1);
+        }
+
+        /// \brief Returns the number of slots.
+        uint64_t getSlots(void) const
+        {
+            return this->slots;
+        }
+
+        /// \brief Returns the number of files on the table.
+        uint64_t getItems(void) const
+        {
+            return this->items;
+        }
+
+        /// \brief Reset the table.
+        ///
+        /// Remove all files, keeping the slots.
+        void reset(void);
+
+        /// \brief Add a file.
+        ///
+        /// \param fname null terminated std string.
+        void addFile(const std::string &fname)
+            { this->addFile(fname.c_str()); }
+
+        /// \brief Add a file.
+        ///
+        /// Store the fingerprint of the file, growing the table when 7/8 of
+        /// its slots are in use.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        void addFile(const char *fname);
+
+        /// \brief Check a file.
+        ///
+        /// \param fname null terminated std string.
+        /// \return true if present, false otherwise.
+        bool checkFile(const std::string &fname) const
+            { return this->checkFile(fname.c_str()); }
+
+        /// \brief Check a file.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return true if present, false otherwise.
+        bool checkFile(const char *fname) const;
+
+        /// \brief Returns the compressed table.
+        ///
+        /// Exports the sorted fingerprints, 8 bytes per file.
+        ///
+        /// \return std string with table compressed and encoded.
+        std::string getHTable(void) const;
+
+        /// \brief Set the table.
+        ///
+        /// Decode and decompress a table exported by getHTable, than set it
+        /// as current table.
+        ///
+        /// \param str Compressed and B64 encoded table
+        void setHTable(std::string str);
+
+        /// \brief Merge table
+        ///
+        /// Decode and decompress a table exported by getHTable, than add its
+        /// files to current table.
+        ///
+        /// \param str Compressed and B64 encoded table
+        void mergeHTable(std::string str);
+
+        /// \brief Merge table
+        ///
+        /// Add the files of table to current table.
+        ///
+        /// \param table the table to merge
+        void mergeHTable(const HTExactFileVersioning &table);
+
+    protected:
+        uint8_t *ctrl;   ///< Control byte of each slot, ctrlEmpty or a tag
+        uint64_t *keys;  ///< Fingerprint of each slot
+        uint64_t slots;  ///< Number of slots, power of two
+        uint64_t items;  ///< Slots in use
+
+        static const uint8_t ctrlEmpty = 0x80; ///< Control of an empty slot
+
+        /// \brief Allocates an empty table.
+        ///
+        /// \param slots number of slots, power of two and at least minSlots.
+        void configure(uint64_t slots);
+
+        /// \brief Hash a file.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return the 64b fingerprint of the file.
+        static uint64_t fingerprint(const char *fname);
+
+        /// \brief Check a fingerprint.
+        ///
+        /// \param key the fingerprint.
+        /// \return true if present, false otherwise.
+        bool checkKey(uint64_t key) const;
+
+        /// \brief Add a fingerprint.
+        ///
+        /// \param key the fingerprint.
+        void addKey(uint64_t key);
+
+        /// \brief Stores a fingerprint known to be absent, without growing.
+        ///
+        /// \param key the fingerprint.
+        void insertKey(uint64_t key);
+
+        /// \brief Doubles the slots, keeping the fingerprints.
+        void grow(void);
+};
+
+#endif
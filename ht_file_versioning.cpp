@@ -2,179 +2,1118 @@
 
 #include "one_at_time.hpp"
 #include "htb64.h"
+#include "ht_kernels.h"
 
 #include <sstream>
 #include <iostream>
 #include <iterator>
 #include <vector>
-#include <map>
+#include <algorithm>
+
+#include <math.h>
+#include <stdlib.h>
+#include <new>
+
+#ifdef HT_WITH_LZMA
+#include <lzma.h>
+#endif
+
+const uint64_t HTFileVersioning::blockBitsLen;
+const uint64_t HTFileVersioning::legacyBitsLen;
+const uint64_t HTFileVersioning::maxBitsLen;
+const uint8_t HTFileVersioning::maxProbes;
+const uint8_t HTFileVersioning::headerMagic;
+const uint8_t HTFileVersioning::headerVersion;
+const uint8_t HTFileVersioning::headerLen;
+const uint8_t HTFileVersioning::headerCrcAt;
+const uint32_t HTDataCompress::lzwClear;
+const uint8_t HTDataCompress::lzwVarMaxBits;
+const uint8_t HTDataCompress::lzwVarMaxBitsLimit;
+const uint32_t HTDataCompress::autoBudgetUs;
+const uint32_t HTDataCompress::lzmaPreset;
+const uint8_t HTDataCompress::riceMaxK;
+const uint8_t HTFileVersioning::kindBits;
+const uint8_t HTFileVersioning::kindCounting;
+const uint8_t HTFileVersioning::kindCuckoo;
+const uint8_t HTFileVersioning::kindFuse;
+const uint8_t HTFileVersioning::kindExact;
+const size_t HTFileVersioning::prefetchWindow;
+const size_t HTFileVersioning::tailFpsLen;
+const uint64_t HTFileVersioning::legacyReachableBits;
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) &&
+    ATOMIC_LLONG_LOCK_FREE == 2, "Concurrent mode needs lock free 64b words");
+
+/// An entry of the LZW compress dictionary: the code of a string extended
+/// by a byte, keyed by (prefix code, byte).
+struct LzwSlot {
+    uint64_t key;   ///< generation<<40 | prefix<<8 | byte
+    uint32_t code;  ///< code of the extended string
+};
+
+/// An entry of the LZW decompress dictionary.
+struct LzwEntry {
+    uint32_t prefix; ///< code of the string without its last byte
+    uint32_t len;    ///< length of the string
+    uint8_t byte;    ///< last byte of the string
+    uint8_t first;   ///< first byte of the string
+};
+
+/// Width of the j-th variable width code after a clear: enough for every
+/// code the dictionary may hold by then, up to max_bits.
+static inline uint8_t lzwVarWidth(uint64_t j, uint8_t max_bits)
+{
+    uint8_t bits = 64 - __builtin_clzll(256 + j);
+    return bits > max_bits ? max_bits : bits;
+}
 
-uint8_t HTFileVersioning::bklenght = 12;
+/// Output iterator packing LZW codes at growing widths, a 64 bits
+/// accumulator stores 32 bits at time.
+class LzwVarWriter {
+    public:
+        LzwVarWriter(std::vector<uint8_t> &out, uint8_t max_bits):
+            out(&out), acc(0), filled(0), j(0),
+            maxBits(max_bits ? max_bits : 32)
+        { }
+
+        LzwVarWriter &operator*(void) { return *this; }
+        LzwVarWriter &operator++(void) { return *this; }
+        LzwVarWriter &operator++(int) { return *this; }
+
+        LzwVarWriter &operator=(uint32_t code)
+        {
+            acc |= uint64_t(code) << filled;
+            filled += lzwVarWidth(j, maxBits);
+            j = (code == HTDataCompress::lzwClear) ? 0 : j+1;
+            if (filled >= 32) {
+                for (int b=0; b<4; ++b)
+                    out->push_back(uint8_t(acc>>(b*8)));
+                acc >>= 32;
+                filled -= 32;
+            }
+            return *this;
+        }
 
-template < typename Iterator >
-Iterator HTDataCompress::lzw_compress(const char *uncompressed, uint32_t size, Iterator result) 
-{
-    int dictSize = 256;
-    std::map<std::string,int> dictionary;
+        void flush(void)
+        {
+            for (; filled > 0; filled -= (filled < 8) ? filled : 8) {
+                out->push_back(uint8_t(acc));
+                acc >>= 8;
+            }
+        }
+
+    protected:
+        std::vector<uint8_t> *out;
+        uint64_t acc;
+        unsigned filled;
+        uint64_t j;
+        uint8_t maxBits;
+};
+
+/// Output iterator packing LZW codes 256 at time, each chunk at the width of
+/// the largest code so far. A chunk is 32 bytes per bit of width, so chunks
+/// stay byte aligned, and flush moves the narrower ones to the width of the
+/// largest code of all.
+class LzwWriter {
+    public:
+        static const size_t chunkCodes = 256; ///< Codes packed at once
+
+        /// Writes the width, then the codes, at the end of out.
+        LzwWriter(std::vector<uint8_t> &out):
+            out(&out), base(out.size()), width(1), n(0)
+        {
+            out.push_back(this->width);
+        }
+
+        LzwWriter &operator*(void) { return *this; }
+        LzwWriter &operator++(void) { return *this; }
+        LzwWriter &operator++(int) { return *this; }
+
+        LzwWriter &operator=(uint32_t code)
+        {
+            if (code >> this->width)
+                this->width = 64 - __builtin_clzll(code);
+            this->chunk[this->n++] = code;
+            if (this->n == chunkCodes) {
+                size_t at = this->out->size();
+                this->out->resize(at + chunkCodes/8*this->width);
+                HTKernels::packBits(this->chunk, chunkCodes, this->width,
+                    &(*this->out)[at]);
+                this->widths.push_back(this->width);
+                this->n = 0;
+            }
+            return *this;
+        }
+
+        void flush(void)
+        {
+            // From the last chunk, the new place of a chunk only covers
+            // itself and the chunks after it
+            const size_t step = chunkCodes/8;
+            size_t whole = this->widths.size();
+            size_t end = this->out->size() - this->base - 1;
+            uint32_t codes[chunkCodes];
+
+            this->out->resize(this->base + 1 + whole*step*this->width +
+                (this->n*this->width + 7)/8);
+            uint8_t *p = &(*this->out)[this->base + 1];
+            for (size_t c=whole; c-- > 0; ) {
+                end -= step*this->widths[c];
+                if (this->widths[c] == this->width &&
+                    end == c*step*this->width)
+                    break;
+                HTKernels::unpackBits(p + end, chunkCodes, this->widths[c],
+                    codes);
+                HTKernels::packBits(codes, chunkCodes, this->width,
+                    p + c*step*this->width);
+            }
+            HTKernels::packBits(this->chunk, this->n, this->width,
+                p + whole*step*this->width);
+            (*this->out)[this->base] = this->width;
+        }
 
-    for (int i = 0; i < 256; i++)
-        dictionary[std::string(1, i)] = i;
+    protected:
+        std::vector<uint8_t> *out;
+        size_t base;
+        uint8_t width;
+        size_t n;
+        std::vector<uint8_t> widths;
+        uint32_t chunk[chunkCodes];
+};
 
-    std::string w;
-    for (uint32_t it=0; it<size; ++it) {
-        char c = uncompressed[it];
-        std::string wc = w + c;
-        if (dictionary.count(wc))
-            w = wc;
+template < typename Iterator >
+Iterator HTDataCompress::lzw_compress(const char *uncompressed, size_t size,
+    Iterator result, uint32_t first, uint8_t max_bits)
+{
+    if (!size)
+        return result;
+
+    // Single bytes are their own codes, each emitted code adds one string
+    // until the dictionary is full, so a table of twice that is never more
+    // than half full. A clear starts a new generation of slots
+    uint64_t limit = max_bits ? uint64_t(1)<<max_bits : uint64_t(1)<<32;
+    uint64_t entries = std::min(uint64_t(size), limit-first);
+    uint64_t slots = 2;
+    uint8_t shift = 63;
+    while (slots < 2*entries) {
+        slots <<= 1;
+        --shift;
+    }
+    std::vector<LzwSlot> dictionary(slots);
+
+    const uint8_t *in = (const uint8_t*)uncompressed;
+    uint64_t generation = uint64_t(1)<<40;
+    uint64_t dictSize = first;
+    uint32_t w = in[0];
+    for (size_t it=1; it<size; ++it) {
+        uint64_t key = generation | (uint64_t(w)<<8) | in[it];
+        uint64_t s = (key*0x9E3779B97F4A7C15ULL)>>shift;
+        while ((dictionary[s].key>>40) == (generation>>40) &&
+            dictionary[s].key != key)
+            s = (s+1) & (slots-1);
+
+        if (dictionary[s].key == key)
+            w = dictionary[s].code;
         else {
-            *result++ = dictionary[w];
-            dictionary[wc] = dictSize++;
-            w = std::string(1, c);
+            *result++ = w;
+            if (dictSize == limit) {
+                *result++ = lzwClear;
+                generation += uint64_t(1)<<40;
+                dictSize = first;
+            } else {
+                dictionary[s].key = key;
+                dictionary[s].code = dictSize++;
+            }
+            w = in[it];
         }
     }
 
-    if (!w.empty())
-        *result++ = dictionary[w];
+    *result++ = w;
     return result;
 }
 
-void HTDataCompress::compress(uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len)
+void HTDataCompress::lzwCompress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
 {
-    uint16_t bits = 1;
-    uint32_t max = 0;
-    uint32_t bits_size = 0;
+    LzwWriter writer(out);
+    writer = HTDataCompress::lzw_compress((const char*)in, in_len, writer);
+    writer.flush();
+}
 
-    std::vector<uint32_t> compressed;
-    HTDataCompress::lzw_compress(
-        (const char*)in,
-        in_len,
-        std::back_inserter(compressed)
-    );
+void HTDataCompress::lzwVarCompress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
+{
+    out.reserve(out.size() + in_len/4 + 16);
+    out.push_back(lzwVarMaxBits);
+    LzwVarWriter writer(out, lzwVarMaxBits);
+    writer = HTDataCompress::lzw_compress((const char*)in, in_len, writer,
+        lzwClear+1, lzwVarMaxBits);
+    writer.flush();
+}
 
-    for (unsigned a=0; a<compressed.size(); ++a)
-        if (max < compressed[a]) 
-            max = compressed[a];
+/// Writes the string of code backwards from its end, the bytes past
+/// out_len are dropped.
+static inline void lzwWrite(const LzwEntry *dictionary, uint32_t code,
+    uint64_t pos, uint8_t *out, size_t out_len)
+{
+    for (uint64_t p=pos+dictionary[code].len; p-- > pos; ) {
+        if (p < out_len)
+            out[p] = dictionary[code].byte;
+        code = dictionary[code].prefix;
+    }
+}
 
-    while (max > unsigned(1<<(bits-1)))
-        ++bits;
-    --bits;
+/// Adds the string w plus the first byte of k, k may be that string.
+static inline void lzwAdd(LzwEntry *dictionary, uint32_t &dictSize,
+    uint32_t w, uint32_t k)
+{
+    if (k > dictSize)
+        throw "Bad compressed k";
+
+    LzwEntry &entry = dictionary[dictSize++];
+    entry.prefix = w;
+    entry.len = dictionary[w].len + 1;
+    entry.byte = dictionary[k == dictSize-1 ? w : k].first;
+    entry.first = dictionary[w].first;
+}
 
-    bits_size = bits*compressed.size();
-    (*out_len) = bits_size/8;
-    (*out_len) += (bits_size%8) ? 2 : 1;
+/// Fills the single byte strings of a decompress dictionary.
+static void lzwInit(std::vector<LzwEntry> &dictionary)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        dictionary[i].len = 1;
+        dictionary[i].byte = dictionary[i].first = i;
+    }
+}
 
-    (*out) = new uint8_t[*out_len]();
-    bzero(*out, *out_len);
-    (**out) = bits;
+uint64_t HTDataCompress::lzw_decompress(const uint8_t *in, size_t n,
+    uint8_t width, uint8_t *out, size_t out_len)
+{
+    if (!n)
+        return 0;
+
+    // Each code after the first adds one string
+    std::vector<LzwEntry> dictionary(256 + n);
+    lzwInit(dictionary);
+
+    // Codes are unpacked a chunk at a time, each chunk starts on a byte
+    const size_t chunk = 256;
+    uint32_t codes[chunk];
+    uint32_t dictSize = 256;
+    uint32_t w = 0;
+    uint64_t pos = 0;
+
+    for (size_t i=0; i<n; i+=chunk) {
+        size_t len = n-i < chunk ? n-i : chunk;
+        size_t c = 0;
+        HTKernels::unpackBits(in + i/8*width, len, width, codes);
+
+        if (!i) {
+            w = codes[c++];
+            if (w >= dictSize)
+                throw "Bad compressed k";
+            lzwWrite(&dictionary[0], w, 0, out, out_len);
+            pos = 1;
+        }
+        for (; c<len; ++c) {
+            uint32_t k = codes[c];
+            lzwAdd(&dictionary[0], dictSize, w, k);
+
+            if (pos < out_len)
+                lzwWrite(&dictionary[0], k, pos, out, out_len);
+            pos += dictionary[k].len;
+            w = k;
+        }
+    }
 
-    uint32_t bitindex = 8;
-    for (unsigned a=0; a<compressed.size(); ++a) {
-        uint32_t value = compressed[a];
-        uint8_t *pvalue = (uint8_t*)(&value);
+    return pos;
+}
 
-        for (unsigned b=0; b<bits;) {
-            uint8_t rembi = bitindex%8;
-            uint8_t remanting = bits-b;
-            uint8_t consume = 8 - rembi;
-            consume = (consume>remanting) ? remanting : consume;
+uint64_t HTDataCompress::lzw_decompress_var(const uint8_t *in, size_t in_len,
+    uint8_t max_bits, uint8_t *out, size_t out_len)
+{
+    // Codes take 9 bits at least, no padding holds one, and each adds at
+    // most a string
+    uint64_t limit = max_bits ? uint64_t(1)<<max_bits : uint64_t(1)<<32;
+    std::vector<LzwEntry> dictionary(std::min(limit,
+        lzwClear+1 + uint64_t(in_len)*8/9));
+    lzwInit(dictionary);
+
+    uint32_t dictSize = lzwClear+1;
+    uint32_t w = lzwClear;
+    uint64_t pos = 0, bit = 0, j = 0;
+    for (;;) {
+        uint8_t width = lzwVarWidth(j, max_bits ? max_bits : 32);
+        if (bit + width > uint64_t(in_len)*8)
+            break;
+
+        uint64_t word = 0;
+        if (bit/8 + 8 <= in_len)
+            memcpy(&word, in + bit/8, 8);
+        else
+            for (size_t b=bit/8; b<in_len; ++b)
+                word |= uint64_t(in[b]) << ((b - bit/8)*8);
+        uint32_t k = uint32_t((word >> (bit&7)) &
+            ((uint64_t(1)<<width) - 1));
+        bit += width;
+
+        if (k == lzwClear) {
+            dictSize = lzwClear+1;
+            w = lzwClear;
+            j = 0;
+            continue;
+        }
+        ++j;
+
+        if (w == lzwClear) {
+            if (k >= 256)
+                throw "Bad compressed k";
+        } else {
+            if (dictSize == limit)
+                throw "Bad compressed k";
+            lzwAdd(&dictionary[0], dictSize, w, k);
+        }
 
-            uint8_t c = pvalue[b/8]>>(b%8);
-            c |= pvalue[b/8+1]<<(8-(b%8));
+        if (pos < out_len)
+            lzwWrite(&dictionary[0], k, pos, out, out_len);
+        pos += dictionary[k].len;
+        w = k;
+    }
 
-            uint16_t filter = (1<<(consume+1))-1;
-            (*out)[(bitindex/8)] |= (c&filter)<<rembi;
+    return pos;
+}
+
+void HTDataCompress::lzwDecompress(const uint8_t *in, size_t in_len,
+    uint8_t *out, size_t out_len)
+{
+    if (!in_len)
+        throw "Bad compressed width";
+    uint8_t bits_size = *in;
+    if (!bits_size || bits_size > 32)
+        throw "Bad compressed width";
+
+    // Every whole code of the stream, the padding of the last byte holds
+    // less than a code (or codes past out_len, for widths below 8)
+    size_t n = uint64_t(in_len-1)*8/bits_size;
+    HTDataCompress::lzw_decompress(in+1, n, bits_size, out, out_len);
+}
 
-            b += consume;
-            bitindex += consume;
+void HTDataCompress::lzwVarDecompress(const uint8_t *in, size_t in_len,
+    uint8_t *out, size_t out_len)
+{
+    if (!in_len)
+        throw "Bad compressed width";
+    uint8_t max_bits = *in;
+    if (max_bits && (max_bits < 9 || max_bits > lzwVarMaxBitsLimit))
+        throw "Bad compressed width";
+    HTDataCompress::lzw_decompress_var(in+1, in_len-1, max_bits, out,
+        out_len);
+}
+
+static inline void putVarint(std::vector<uint8_t> &out, uint64_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        out.push_back(uint8_t(v) | 0x80);
+    out.push_back(uint8_t(v));
+}
+
+static inline uint64_t getVarint(const uint8_t *&in, const uint8_t *end)
+{
+    uint64_t v = 0;
+    for (unsigned shift=0; in < end && shift < 64; shift += 7) {
+        uint8_t b = *in++;
+        v |= uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    throw "Bad compressed table";
+}
+
+static void rawCompress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
+{
+    out.insert(out.end(), in, in+in_len);
+}
+
+static void rawDecompress(const uint8_t *in, size_t in_len, uint8_t *out,
+    size_t out_len)
+{
+    memcpy(out, in, std::min(in_len, out_len));
+}
+
+// Pairs of (zero bytes, literal bytes) counts, each followed by its
+// literals
+static void rle0Compress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
+{
+    for (size_t a=0; a<in_len; ) {
+        size_t zeros = a;
+        while (zeros < in_len && !in[zeros])
+            ++zeros;
+        size_t lits = zeros;
+        while (lits < in_len && in[lits])
+            ++lits;
+        putVarint(out, zeros-a);
+        putVarint(out, lits-zeros);
+        out.insert(out.end(), in+zeros, in+lits);
+        a = lits;
+    }
+}
+
+static void rle0Decompress(const uint8_t *in, size_t in_len, uint8_t *out,
+    size_t out_len)
+{
+    const uint8_t *end = in+in_len;
+    for (uint64_t pos=0; in < end; ) {
+        uint64_t zeros = getVarint(in, end);
+        uint64_t lits = getVarint(in, end);
+        if (zeros > out_len-pos || lits > out_len-pos-zeros ||
+            lits > uint64_t(end-in))
+            throw "Bad compressed table";
+        memcpy(out+pos+zeros, in, lits);
+        in += lits;
+        pos += zeros+lits;
+    }
+}
+
+/// Sets each bit visited.
+struct SetBit {
+    uint8_t *out;
+
+    void operator()(uint64_t pos)
+    {
+        out[pos>>3] |= uint8_t(1) << (pos&7);
+    }
+};
+
+/// Only walks the bits, to check a payload.
+struct SkipBit {
+    void operator()(uint64_t) {}
+};
+
+// The position of each bit set, as the gap from the previous one
+static void sparseCompress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
+{
+    uint64_t next = 0;
+    for (size_t a=0; a<in_len; a+=8) {
+        uint64_t word = 0;
+        memcpy(&word, in+a, std::min(in_len-a, size_t(8)));
+        for (; word; word &= word-1) {
+            uint64_t pos = uint64_t(a)*8 + __builtin_ctzll(word);
+            putVarint(out, pos-next);
+            next = pos+1;
         }
     }
 }
 
-template < typename Iterator >
-std::string HTDataCompress::lzw_decompress(Iterator begin, Iterator end)
+template <typename Visit>
+static void sparseBits(const uint8_t *in, size_t in_len, uint64_t nbits,
+    Visit &visit)
+{
+    const uint8_t *end = in+in_len;
+    for (uint64_t pos=0; in < end; ++pos) {
+        uint64_t gap = getVarint(in, end);
+        if (gap >= nbits-pos)
+            throw "Bad compressed table";
+        pos += gap;
+        visit(pos);
+    }
+}
+
+static void sparseDecompress(const uint8_t *in, size_t in_len, uint8_t *out,
+    size_t out_len)
 {
-    int dictSize = 256;
-    std::map< int, std::string > dictionary;
+    SetBit set = {out};
+    sparseBits(in, in_len, uint64_t(out_len)*8, set);
+}
+
+static void sparseOrBits(const uint8_t *in, size_t in_len, uint8_t *out,
+    uint64_t nbits)
+{
+    SkipBit check;
+    sparseBits(in, in_len, nbits, check);
+    if (!out)
+        return;
+    SetBit set = {out};
+    sparseBits(in, in_len, nbits, set);
+}
+
+/// Little endian bit writer.
+struct RiceWriter {
+    std::vector<uint8_t> &out;
+    uint64_t acc;       ///< Pending bits, less than a byte between puts
+    unsigned n;         ///< How many
+
+    RiceWriter(std::vector<uint8_t> &out) : out(out), acc(0), n(0) {}
 
-    for (int i = 0; i < 256; i++) {
-        dictionary[i] = std::string(1, i);
+    /// Appends the w (up to 56) low bits of v.
+    void put(uint64_t v, unsigned w)
+    {
+        acc |= v << n;
+        for (n += w; n >= 8; n -= 8, acc >>= 8)
+            out.push_back(uint8_t(acc));
     }
 
-    std::string w(1, *begin++);
-    std::string result = w;
-    std::string entry;
+    /// Appends gap: its quotient in unary (zeros ended by a one), then
+    /// its k low bits.
+    void putGap(uint64_t gap, uint8_t k)
+    {
+        uint64_t q = gap >> k, r = gap & ((uint64_t(1) << k) - 1);
+        if (q+1+k <= 56)
+            return this->put(((r << 1) | 1) << q, q+1+k);
+        for (; q >= 32; q -= 32)
+            this->put(0, 32);
+        this->put(uint64_t(1) << q, q+1);
+        this->put(r, k);
+    }
 
-    for ( ; begin != end; begin++) {
-        int k = *begin;
-        if (dictionary.count(k)) {
-            entry = dictionary[k];
-        } else if (k == dictSize) {
-            entry = w + w[0];
-        } else
-            throw "Bad compressed k";
+    void flush()
+    {
+        if (n)
+            out.push_back(uint8_t(acc));
+    }
+};
+
+/// Little endian bit reader, throws past the end of the payload.
+struct RiceReader {
+    const uint8_t *in, *end;
+    uint64_t acc;       ///< Bits read ahead
+    unsigned n;         ///< How many, up to 56
+
+    void refill()
+    {
+        for (; n <= 48 && in < end; n += 8)
+            acc |= uint64_t(*in++) << n;
+    }
 
-        result += entry;
-        dictionary[dictSize++] = w + entry[0];
-        w = entry;
+    uint64_t getUnary()
+    {
+        for (uint64_t q=0;;) {
+            this->refill();
+            if (acc) {
+                unsigned z = __builtin_ctzll(acc);
+                acc >>= z+1;
+                n -= z+1;
+                return q+z;
+            }
+            if (!n)
+                throw "Bad compressed table";
+            q += n;
+            n = 0;
+        }
     }
 
-    return result;
+    uint64_t get(uint8_t k)
+    {
+        this->refill();
+        if (n < k)
+            throw "Bad compressed table";
+        uint64_t v = acc & ((uint64_t(1) << k) - 1);
+        acc >>= k;
+        n -= k;
+        return v;
+    }
+};
+
+// The Rice parameter of count bits set out of nbits: gaps are about
+// geometric, so the remainders take log2 of ln 2 times their mean
+static uint8_t riceParameter(uint64_t nbits, uint64_t count)
+{
+    uint64_t mean = count ? (nbits-count)/count : 0;
+    mean -= (mean>>2) + (mean>>4);
+    uint8_t k = 0;
+    while (k < HTDataCompress::riceMaxK && (uint64_t(2) << k) <= mean)
+        ++k;
+    return k;
 }
 
-void HTDataCompress::decompress(uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+// The Rice parameter, the count of bits set and the gaps as with
+// sparseCompress, Rice coded
+static void riceCompress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
 {
-    bzero(out, out_len);
+    uint64_t count = 0;
+    for (size_t a=0; a<in_len; a+=8) {
+        uint64_t word = 0;
+        memcpy(&word, in+a, std::min(in_len-a, size_t(8)));
+        count += __builtin_popcountll(word);
+    }
+    uint8_t k = riceParameter(uint64_t(in_len)*8, count);
+    out.push_back(k);
+    putVarint(out, count);
+
+    RiceWriter writer(out);
+    uint64_t next = 0;
+    for (size_t a=0; a<in_len; a+=8) {
+        uint64_t word = 0;
+        memcpy(&word, in+a, std::min(in_len-a, size_t(8)));
+        for (; word; word &= word-1) {
+            uint64_t pos = uint64_t(a)*8 + __builtin_ctzll(word);
+            writer.putGap(pos-next, k);
+            next = pos+1;
+        }
+    }
+    writer.flush();
+}
 
-    std::vector< uint32_t > compressed;
-    uint8_t bits_size = *in;
+template <typename Visit>
+static void riceBits(const uint8_t *in, size_t in_len, uint64_t nbits,
+    Visit &visit)
+{
+    const uint8_t *end = in+in_len;
+    if (in == end || *in > HTDataCompress::riceMaxK)
+        throw "Bad compressed table";
+    uint8_t k = *in++;
+    uint64_t count = getVarint(in, end);
+    if (count > nbits)
+        throw "Bad compressed table";
+
+    RiceReader reader = {in, end, 0, 0};
+    for (uint64_t pos=0; count; --count, ++pos) {
+        uint64_t q = reader.getUnary();
+        if (q > (nbits >> k))
+            throw "Bad compressed table";
+        uint64_t gap = (q << k) | reader.get(k);
+        if (gap >= nbits-pos)
+            throw "Bad compressed table";
+        pos += gap;
+        visit(pos);
+    }
+}
 
-    for (uint32_t bitindex=8; (bitindex+8)/8<in_len;) {
+static void riceDecompress(const uint8_t *in, size_t in_len, uint8_t *out,
+    size_t out_len)
+{
+    SetBit set = {out};
+    riceBits(in, in_len, uint64_t(out_len)*8, set);
+}
 
-        uint32_t value = 0;
-        uint8_t  *pvalue = (uint8_t*)(&value);
+static void riceOrBits(const uint8_t *in, size_t in_len, uint8_t *out,
+    uint64_t nbits)
+{
+    SkipBit check;
+    riceBits(in, in_len, nbits, check);
+    if (!out)
+        return;
+    SetBit set = {out};
+    riceBits(in, in_len, nbits, set);
+}
 
-        for (unsigned b=0; b<bits_size;) {
-            uint8_t rembi = bitindex%8;
+#ifdef HT_WITH_LZMA
+static void lzmaCompress(const uint8_t *in, size_t in_len,
+    std::vector<uint8_t> &out)
+{
+    size_t base = out.size(), pos = base;
+    out.resize(base + lzma_stream_buffer_bound(in_len));
+    if (lzma_easy_buffer_encode(HTDataCompress::lzmaPreset, LZMA_CHECK_NONE,
+        NULL, in, in_len, &out[0], &pos, out.size()) != LZMA_OK)
+        throw "LZMA compress failed";
+    out.resize(pos);
+}
 
-            uint8_t remanting = bits_size-b;
-            uint8_t rem_to_in_byte = 8 - rembi;
-            uint8_t rem_to_out_byte = 8 - (b%8);
+static void lzmaDecompress(const uint8_t *in, size_t in_len, uint8_t *out,
+    size_t out_len)
+{
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos = 0, out_pos = 0;
+    if (lzma_stream_buffer_decode(&memlimit, 0, NULL, in, &in_pos, in_len,
+        out, &out_pos, out_len) != LZMA_OK)
+        throw "Bad compressed table";
+}
+#endif
+
+const HTDataCompress::CodecEntry HTDataCompress::codecs[] = {
+    {CODEC_RAW, rawCompress, rawDecompress, NULL, 0, false},
+    {CODEC_SPARSE, sparseCompress, sparseDecompress, sparseOrBits, 2000, true},
+    {CODEC_RICE, riceCompress, riceDecompress, riceOrBits, 2000, true},
+    {CODEC_RLE0, rle0Compress, rle0Decompress, NULL, 2000, true},
+    {CODEC_LZW_VAR, lzwVarCompress, lzwVarDecompress, NULL, 80000, false},
+#ifdef HT_WITH_LZMA
+    {CODEC_LZMA, lzmaCompress, lzmaDecompress, NULL, 150000, false},
+#endif
+    {CODEC_LZW, lzwCompress, lzwDecompress, NULL, 0, false},
+    {CODEC_AUTO, NULL, NULL, NULL, 0, false}
+};
+
+const HTDataCompress::CodecEntry *HTDataCompress::findCodec(Codec codec)
+{
+    for (const CodecEntry *entry=codecs; entry->compress; ++entry)
+        if (entry->codec == codec)
+            return entry;
+    return NULL;
+}
 
-            uint8_t consume = (remanting>rem_to_in_byte) ? rem_to_in_byte : remanting;
-            consume = (consume>rem_to_out_byte) ? rem_to_out_byte : consume;
+bool HTDataCompress::hasCodec(Codec codec)
+{
+    return findCodec(codec) != NULL;
+}
 
-            uint8_t c = in[bitindex/8]>>(bitindex%8);
-            c |= pvalue[bitindex/8+1]<<(8-(bitindex%8));
+HTDataCompress::Codec HTDataCompress::compress(uint8_t *in, size_t in_len,
+    uint8_t **out, size_t *out_len, Codec codec, uint32_t budget_us)
+{
+    std::vector<uint8_t> packed;
+
+    if (codec == CODEC_AUTO) {
+        // Raw is the baseline and the linear codecs are always tried; the
+        // others only when their cost, estimated from in_len alone, fits in
+        // the budget, so the same table always gets the same codec
+        std::vector<uint8_t> candidate;
+        codec = CODEC_RAW;
+        rawCompress(in, in_len, packed);
+        for (const CodecEntry *entry=codecs; entry->compress; ++entry) {
+            if (!entry->psPerByte)
+                continue;
+            if (!entry->linear &&
+                uint64_t(in_len)*entry->psPerByte/1000000 > budget_us)
+                continue;
+            candidate.clear();
+            entry->compress(in, in_len, candidate);
+            if (candidate.size() < packed.size()) {
+                packed.swap(candidate);
+                codec = entry->codec;
+            }
+        }
+    } else {
+        const CodecEntry *entry = findCodec(codec);
+        if (!entry)
+            throw "Unknown table codec";
+        entry->compress(in, in_len, packed);
+    }
 
-            uint16_t filter = (1<<(consume))-1;
-            pvalue[(b/8)] |= (c&filter)<<(b%8);
+    (*out_len) = packed.size();
+    (*out) = new uint8_t[packed.size() + 1]();
+    if (!packed.empty())
+        memcpy(*out, &packed[0], packed.size());
+    return codec;
+}
 
-            b += consume;
-            bitindex += consume;
+bool HTDataCompress::orBits(const uint8_t *in, size_t in_len, uint8_t *out,
+    uint64_t nbits, Codec codec)
+{
+    const CodecEntry *entry = findCodec(codec);
+    if (!entry || !entry->orBits)
+        return false;
+    entry->orBits(in, in_len, out, nbits);
+    return true;
+}
+
+void HTDataCompress::decompress(uint8_t *in, size_t in_len, uint8_t *out,
+    size_t out_len, Codec codec)
+{
+    bzero(out, out_len);
+
+    const CodecEntry *entry = findCodec(codec);
+    if (!entry)
+        throw "Unknown table codec";
+    entry->decompress(in, in_len, out, out_len);
+}
+
+/// wyhash (Wang Yi, final version) secret.
+static const uint64_t wySecret[4] = {0xa0761d6478bd642fULL,
+    0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+
+static inline void wyMum(uint64_t *a, uint64_t *b)
+{
+    unsigned __int128 r = (unsigned __int128)(*a) * (*b);
+    (*a) = uint64_t(r);
+    (*b) = uint64_t(r>>64);
+}
+
+static inline uint64_t wyMix(uint64_t a, uint64_t b)
+{
+    wyMum(&a, &b);
+    return a^b;
+}
+
+static inline uint64_t wyR8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyR4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/// wyhash of a buffer, 8 or 16 bytes per multiply.
+static uint64_t wyhash(const uint8_t *p, size_t len, uint64_t seed)
+{
+    uint64_t a, b;
+
+    seed ^= wyMix(seed ^ wySecret[0], wySecret[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyR4(p)<<32) | wyR4(p + ((len>>3)<<2));
+            b = (wyR4(p+len-4)<<32) | wyR4(p + len - 4 - ((len>>3)<<2));
+        } else if (len > 0) {
+            a = (uint64_t(p[0])<<16) | (uint64_t(p[len>>1])<<8) | p[len-1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wyMix(wyR8(p) ^ wySecret[1], wyR8(p+8) ^ seed);
+                see1 = wyMix(wyR8(p+16) ^ wySecret[2], wyR8(p+24) ^ see1);
+                see2 = wyMix(wyR8(p+32) ^ wySecret[3], wyR8(p+40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
         }
+        while (i > 16) {
+            seed = wyMix(wyR8(p) ^ wySecret[1], wyR8(p+8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyR8(p+i-16);
+        b = wyR8(p+i-8);
+    }
+    a ^= wySecret[1];
+    b ^= seed;
+    wyMum(&a, &b);
+    return wyMix(a ^ wySecret[0] ^ len, b ^ wySecret[1]);
+}
+
+/// Optimal number of probes for a table of bits with items.
+static uint8_t optimalProbes(uint64_t bits, uint64_t items)
+{
+    double k = floor(double(bits)/double(items)*M_LN2 + 0.5);
+    if (k < 1) k = 1;
+    if (k > HTFileVersioning::maxProbes) k = HTFileVersioning::maxProbes;
+    return uint8_t(k);
+}
 
-        compressed.push_back(value);
+/// False positive rate of a blocked table, the number of files per block
+/// follows a Poisson distribution.
+static double blockedFpr(uint64_t bits, uint64_t items, uint8_t probes)
+{
+    double lambda = double(items)/double(bits/HTFileVersioning::blockBitsLen);
+    double p = exp(-lambda);
+    double fpr = 0;
+    uint64_t last = uint64_t(lambda + 10*sqrt(lambda) + 10);
+
+    for (uint64_t j=0; j<=last; ++j) {
+        double fill = 1 - pow(1 - 1.0/HTFileVersioning::blockBitsLen,
+            double(probes)*j);
+        fpr += p*pow(fill, probes);
+        p *= lambda/(j+1);
     }
+    return fpr;
+}
 
-    std::string decompressed = HTDataCompress::lzw_decompress(compressed.begin(), compressed.end());
-    for (unsigned a=0; a<decompressed.size() && a<out_len; ++a) 
-        out[a] = decompressed[a];
+HTFileVersioning::HTFileVersioning(void):
+    shashtable(NULL), bits(0), probes(0), layout(LAYOUT_FLAT),
+    concurrent(false), fingerprinted(false), family(HASH_ONE_AT_TIME),
+    index(INDEX_WIDE)
+{
+    this->configure(1, legacyBitsLen, LAYOUT_FLAT, INDEX_NIBBLES);
 }
 
-HTFileVersioning::HTFileVersioning(void)
+HTFileVersioning::HTFileVersioning(uint64_t bits):
+    shashtable(NULL), bits(0), probes(0), layout(LAYOUT_FLAT),
+    concurrent(false), fingerprinted(false), family(HASH_ONE_AT_TIME),
+    index(INDEX_WIDE)
 {
-    this->shashtable = new uint8_t[getHTableBytesLen()]();
-    this->reset();
+    this->configure(1, bits);
+}
+
+HTFileVersioning::HTFileVersioning(uint64_t expected_items, double fpr,
+    Layout layout):
+    shashtable(NULL), bits(0), probes(0), layout(LAYOUT_FLAT),
+    concurrent(false), fingerprinted(false), family(HASH_ONE_AT_TIME),
+    index(INDEX_WIDE)
+{
+    if (!expected_items || !(fpr > 0.0) || !(fpr < 1.0))
+        throw "Bad Bloom parameters";
+
+    // m = -n*ln(p)/ln(2)^2, rounded up to whole 64b words
+    double m = -double(expected_items)*log(fpr)/(M_LN2*M_LN2);
+    if (m > double(maxBitsLen))
+        throw "Bad Bloom parameters";
+
+    if (layout == LAYOUT_BLOCKED) {
+        // Overloaded blocks raise the false positive rate, grow the table
+        // until the blocked estimate reaches the target
+        uint64_t len = divRoundUp(uint64_t(ceil(m)), blockBitsLen)*blockBitsLen;
+        while (len < maxBitsLen &&
+            blockedFpr(len, expected_items, optimalProbes(len, expected_items)) > fpr)
+            len += divRoundUp(len/32, blockBitsLen)*blockBitsLen;
+        if (len > maxBitsLen)
+            len = maxBitsLen;
+
+        this->configure(optimalProbes(len, expected_items), len, layout);
+        return;
+    }
+
+    uint64_t len = divRoundUp(uint64_t(ceil(m)), 64)*64;
+    this->configure(optimalProbes(len, expected_items), len);
 }
 
 HTFileVersioning::~HTFileVersioning()
 {
-    delete this->shashtable;
+    free(this->hashtable);
+}
+
+void HTFileVersioning::configure(uint8_t probes, uint64_t bits, Layout layout,
+    Index index)
+{
+    if (!probes || probes > maxProbes || !bits || bits > maxBitsLen)
+        throw "Bad table geometry";
+    if (layout != LAYOUT_FLAT && (layout != LAYOUT_BLOCKED || bits%blockBitsLen))
+        throw "Bad table geometry";
+    if (index > INDEX_WIDE || (index == INDEX_NIBBLES && (probes != 1 ||
+        bits != legacyBitsLen || layout != LAYOUT_FLAT)))
+        throw "Bad table geometry";
+
+    if (!this->hashtable || this->bits != bits) {
+        void *table = NULL;
+        size_t len = divRoundUp(bits, blockBitsLen)*(blockBitsLen/8);
+        if (posix_memalign(&table, 64, len))
+            throw std::bad_alloc();
+        bzero(table, len);
+
+        free(this->hashtable);
+        this->hashtable = table;
+        this->bits = bits;
+    }
+    this->probes = probes;
+    this->layout = layout;
+    this->index = index;
+    this->reset();
+}
+
+uint64_t HTFileVersioning::popcount(void) const
+{
+    uint64_t count = HTKernels::popcount(this->shashtable, this->bits/8);
+    if (this->bits%8)
+        count += __builtin_popcount(
+            this->shashtable[this->bits/8] & ((1<<(this->bits%8))-1));
+    return count;
+}
+
+double HTFileVersioning::fillRatio(void) const
+{
+    // Legacy tables only reach their first 241 words
+    if (this->isLegacy())
+        return double(this->popcount())/legacyReachableBits;
+    return double(this->popcount())/this->bits;
+}
+
+double HTFileVersioning::estimatedItems(void) const
+{
+    double m = this->isLegacy() ? legacyReachableBits : this->bits;
+    double fill = this->fillRatio();
+
+    if (fill >= 1.0)
+        return HUGE_VAL;
+    return -(m/this->probes)*log1p(-fill);
+}
+
+double HTFileVersioning::estimatedFpr(void) const
+{
+    if (this->layout != LAYOUT_BLOCKED)
+        return pow(this->fillRatio(), this->probes);
+
+    uint64_t blocks = this->bits/blockBitsLen;
+    double fpr = 0;
+    for (uint64_t b=0; b<blocks; ++b) {
+        double fill = double(HTKernels::popcount(
+            this->shashtable + b*(blockBitsLen/8), blockBitsLen/8))/blockBitsLen;
+        fpr += pow(fill, this->probes);
+    }
+    return fpr/blocks;
 }
 
 void HTFileVersioning::reset(void)
 {
     bzero(this->hashtable, getHTableBytesLen());
+    this->sortedFps.clear();
+    this->tailFps.clear();
+}
+
+void HTFileVersioning::setFingerprints(bool enabled)
+{
+    if (!enabled) {
+        this->detachFingerprints();
+        return;
+    }
+    if (this->fingerprinted)
+        return;
+    // Files already on the table would be missing from the fingerprints
+    if (this->popcount())
+        throw "Table not empty";
+    if (this->concurrent)
+        throw "Fingerprints need a single writer";
+    this->fingerprinted = true;
+}
+
+void HTFileVersioning::setHashFamily(HashFamily family)
+{
+    if (family == this->family)
+        return;
+    if (family > HASH_WYHASH)
+        throw "Bad hash family";
+    // Files already on the table were hashed with the other family
+    if (this->popcount())
+        throw "Table not empty";
+    this->family = family;
+}
+
+void HTFileVersioning::detachFingerprints(void)
+{
+    this->fingerprinted = false;
+    std::vector<uint32_t>().swap(this->sortedFps);
+    std::vector<uint32_t>().swap(this->tailFps);
+}
+
+uint32_t HTFileVersioning::fingerprint(const uint32_t *hash)
+{
+    uint64_t h1, h2;
+
+    // The probes use the low bits of h1 and h2, mix them again
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+    return uint32_t(HTKernels::fmix64(h1 + h2)>>32);
+}
+
+void HTFileVersioning::addFingerprint(uint32_t fp)
+{
+    this->tailFps.push_back(fp);
+
+    // The unsorted fingerprints are scanned on each hit, keep them a small
+    // fraction of the sorted ones
+    size_t limit = this->sortedFps.size()/64;
+    if (this->tailFps.size() >= (limit > tailFpsLen ? limit : tailFpsLen))
+        this->compactFingerprints();
+}
+
+void HTFileVersioning::compactFingerprints(void)
+{
+    if (this->tailFps.empty())
+        return;
+
+    size_t middle = this->sortedFps.size();
+    std::sort(this->tailFps.begin(), this->tailFps.end());
+    this->sortedFps.insert(this->sortedFps.end(), this->tailFps.begin(),
+        this->tailFps.end());
+    std::inplace_merge(this->sortedFps.begin(),
+        this->sortedFps.begin()+middle, this->sortedFps.end());
+    this->tailFps.clear();
+}
+
+bool HTFileVersioning::checkFingerprint(uint32_t fp) const
+{
+    return HTKernels::searchU32(this->sortedFps.data(), this->sortedFps.size(),
+            fp) ||
+        HTKernels::scanU32(this->tailFps.data(), this->tailFps.size(), fp);
 }
 
 uint8_t HTFileVersioning::getWord(uint8_t *ptr, uint32_t index)
@@ -192,49 +1131,326 @@ void HTFileVersioning::from3WtoIndex(uint8_t *_3w, uint32_t *dbytes_shift,
     (*dbbits_shift) = 1<<_3w[2];
 }
 
-void HTFileVersioning::discoverHighLow(const char *fname, uint8_t *out)
+void HTFileVersioning::hashFile(const char *fname, uint32_t *hash)
 {
-    static uint8_t BUCKETS=2;
-    static uint8_t PROCESS_BUCKETS=2;
+    FixedBuckedOneAtTimeHash<4>::Value v =
+        FixedBuckedOneAtTimeHash<4>::hash(fname);
 
-    bzero(out, sizeof(uint8_t)*3);
-    Hash h(BUCKETS*PROCESS_BUCKETS);
-    Buffer b(fname, strlen(fname));
+    memcpy(hash, v.ihash, sizeof(v.ihash));
+}
 
-    BuckedOneAtTimeHash::hash(b, &h);
+void HTFileVersioning::hashFile(const char *fname, uint32_t *hash,
+    HashFamily family)
+{
+    const uint8_t *buf = (const uint8_t*)fname;
+    size_t len = strlen(fname);
+    uint64_t lo, hi;
+
+    switch (family) {
+        case HASH_CRC32C:
+            // 64 bits of CRCs, spread over the 128b with the length
+            lo = HTKernels::crc32cPair(buf, len) ^ (len*0x9E3779B97F4A7C15ULL);
+            hi = HTKernels::fmix64(lo ^ 0xc4ceb9fe1a85ec53ULL);
+            lo = HTKernels::fmix64(lo);
+            break;
+        case HASH_WYHASH:
+            lo = wyhash(buf, len, 0);
+            hi = wyMix(lo ^ wySecret[2], len ^ wySecret[3]);
+            break;
+        default:
+            HTFileVersioning::hashFile(fname, hash);
+            return;
+    }
+    hash[0] = uint32_t(lo);
+    hash[1] = uint32_t(lo>>32);
+    hash[2] = uint32_t(hi);
+    hash[3] = uint32_t(hi>>32);
+}
+
+void HTFileVersioning::hashFiles(const char * const *fnames, size_t n,
+    uint32_t *hashes)
+{
+    // Batches of 16, the widest the multi buffer hash takes at once
+    Buffer b[16];
+    Hash h[16];
+    Hash four(4);
+
+    for (size_t k=0; k<16 && k<n; ++k)
+        h[k] = four;
+    for (size_t i=0; i<n; i+=16) {
+        size_t len = n-i < 16 ? n-i : 16;
+        for (size_t k=0; k<len; ++k) {
+            b[k] = Buffer(fnames[i+k], strlen(fnames[i+k]));
+            bzero(h[k].hash, h[k].hash_size);
+        }
+        BuckedOneAtTimeHash::hash(b, h, len);
+        for (size_t k=0; k<len; ++k)
+            memcpy(hashes + (i+k)*4, h[k].hash, h[k].hash_size);
+    }
+}
+
+void HTFileVersioning::discoverHighLow(const uint32_t *hash, uint8_t *out)
+{
+    uint32_t folded[2];
+
+    bzero(out, sizeof(uint8_t)*3);
 
     // from 128b(32w) to 64b(16w)
-    h.ihash[0] ^= h.ihash[3];
-    h.ihash[1] ^= h.ihash[2];
+    folded[0] = hash[0] ^ hash[3];
+    folded[1] = hash[1] ^ hash[2];
     //from 64b(16w) to 12b(3w)
     for (int a=0; a<16; a++)
-        out[a%3] ^= HTFileVersioning::getWord(h.shash, a);
+        out[a%3] ^= HTFileVersioning::getWord((uint8_t*)folded, a);
 }
 
-void HTFileVersioning::addFile(const char *fname)
+void HTFileVersioning::discoverProbes(const uint32_t *hash, uint64_t *h1,
+    uint64_t *h2)
+{
+    // Each bucket only sees a quarter of the bytes, paths that differ in a
+    // single byte share 3 buckets, so both halves are mixed with all 128b
+    uint64_t lo = (uint64_t(hash[1])<<32) | hash[0];
+    uint64_t hi = (uint64_t(hash[3])<<32) | hash[2];
+
+    // Probe i is h1 + i*h2 (double hashing) modulo the table size, h2 is odd
+    // so the probes do not repeat on power of two tables
+    (*h1) = HTKernels::fmix64(lo ^ HTKernels::fmix64(hi));
+    (*h2) = HTKernels::fmix64(hi ^ (*h1)) | 1;
+}
+
+void HTFileVersioning::blockMask(uint64_t h2, uint8_t probes, uint64_t *mask)
+{
+    // Double hashing again, inside the block, the odd step never repeats a
+    // bit on the 512 bits of the block
+    uint64_t pos = (h2>>1)%blockBitsLen;
+    uint64_t step = ((h2>>10)%blockBitsLen) | 1;
+
+    bzero(mask, blockBitsLen/8);
+    for (uint8_t p=0; p<probes; ++p) {
+        mask[pos>>6] |= uint64_t(1)<<(pos&63);
+        pos = (pos+step)%blockBitsLen;
+    }
+}
+
+void HTFileVersioning::addHash(const uint32_t *hash)
 {
-    uint8_t out[3];
-    uint16_t bit=0;
-    uint32_t byte=0;
+    if (this->fingerprinted)
+        this->addFingerprint(HTFileVersioning::fingerprint(hash));
+
+    if (this->isLegacy()) {
+        uint8_t out[3];
+        uint16_t bit=0;
+        uint32_t byte=0;
+
+        HTFileVersioning::discoverHighLow(hash, out);
+        HTFileVersioning::from3WtoIndex(out, &byte, &bit);
+
+        if (this->concurrent)
+            this->setBit(byte*16 + out[2]);
+        else
+            (this->dwhashtable[byte]) |= bit;
+        return;
+    }
 
-    HTFileVersioning::discoverHighLow(fname, out);
-    HTFileVersioning::from3WtoIndex(out, &byte, &bit);
+    uint64_t h1, h2;
 
-    (this->dwhashtable[byte]) |= bit;
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+
+    if (this->layout == LAYOUT_BLOCKED) {
+        uint64_t mask[8];
+        uint64_t *block = this->qhashtable + this->blockOf(h1)*8;
+
+        HTFileVersioning::blockMask(h2, this->probes, mask);
+        if (this->concurrent) {
+            std::atomic<uint64_t> *ablock = (std::atomic<uint64_t>*)block;
+            for (int w=0; w<8; ++w)
+                if (mask[w])
+                    ablock[w].fetch_or(mask[w], std::memory_order_relaxed);
+            return;
+        }
+        for (int w=0; w<8; ++w)
+            block[w] |= mask[w];
+        return;
+    }
+
+    for (uint8_t p=0; p<this->probes; ++p)
+        this->setBit(this->probeNext(&h1, &h2, p));
+}
+
+bool HTFileVersioning::checkBits(const uint32_t *hash) const
+{
+    if (this->isLegacy()) {
+        uint8_t out[3];
+        uint16_t bit=0;
+        uint32_t byte=0;
+
+        HTFileVersioning::discoverHighLow(hash, out);
+        HTFileVersioning::from3WtoIndex(out, &byte, &bit);
+
+        if (this->concurrent)
+            return this->testBit(byte*16 + out[2]);
+        return bool(
+            (this->dwhashtable[byte]) & bit
+        );
+    }
+
+    uint64_t h1, h2;
+
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+
+    if (this->layout == LAYOUT_BLOCKED) {
+        uint64_t mask[8];
+        const uint64_t *block =
+            this->qhashtable + this->blockOf(h1)*8;
+
+        HTFileVersioning::blockMask(h2, this->probes, mask);
+        if (this->concurrent) {
+            const std::atomic<uint64_t> *ablock =
+                (const std::atomic<uint64_t>*)block;
+            uint64_t miss = 0;
+            for (int w=0; w<8; ++w)
+                miss |= mask[w] & ~ablock[w].load(std::memory_order_relaxed);
+            return !miss;
+        }
+        return HTKernels::blockTest(block, mask);
+    }
+
+    for (uint8_t p=0; p<this->probes; ++p)
+        if (!this->testBit(this->probeNext(&h1, &h2, p)))
+            return false;
+    return true;
+}
+
+void HTFileVersioning::prefetchHash(const uint32_t *hash, bool write) const
+{
+    // Legacy tables are 512 bytes, always in cache
+    if (this->isLegacy())
+        return;
+
+    uint64_t h1, h2;
+
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+
+    if (this->layout == LAYOUT_BLOCKED) {
+        const uint64_t *block =
+            this->qhashtable + this->blockOf(h1)*8;
+        if (write)
+            __builtin_prefetch(block, 1);
+        else
+            __builtin_prefetch(block, 0);
+        return;
+    }
+
+    for (uint8_t p=0; p<this->probes; ++p) {
+        uint64_t pos = this->probeNext(&h1, &h2, p);
+        if (write)
+            __builtin_prefetch(this->shashtable + (pos>>3), 1);
+        else
+            __builtin_prefetch(this->shashtable + (pos>>3), 0);
+    }
+}
+
+uint8_t HTFileVersioning::probePositions(const uint32_t *hash,
+    uint64_t *pos) const
+{
+    if (this->isLegacy()) {
+        uint8_t out[3];
+        uint16_t bit=0;
+        uint32_t byte=0;
+
+        HTFileVersioning::discoverHighLow(hash, out);
+        HTFileVersioning::from3WtoIndex(out, &byte, &bit);
+
+        pos[0] = uint64_t(byte)*16 + out[2];
+        return 1;
+    }
+
+    uint64_t h1, h2;
+
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+
+    if (this->layout == LAYOUT_BLOCKED) {
+        // Same walk as blockMask, offset by the block
+        uint64_t block = this->blockOf(h1)*blockBitsLen;
+        uint64_t in = (h2>>1)%blockBitsLen;
+        uint64_t step = ((h2>>10)%blockBitsLen) | 1;
+
+        for (uint8_t p=0; p<this->probes; ++p) {
+            pos[p] = block + in;
+            in = (in+step)%blockBitsLen;
+        }
+        return this->probes;
+    }
+
+    for (uint8_t p=0; p<this->probes; ++p)
+        pos[p] = this->probeNext(&h1, &h2, p);
+    return this->probes;
+}
+
+void HTFileVersioning::addFile(const char *fname)
+{
+    uint32_t hash[4];
+
+    HTFileVersioning::hashFile(fname, hash, this->family);
+    this->addHash(hash);
 }
 
 bool HTFileVersioning::checkFile(const char *fname) const
 {
-    uint8_t out[3];
-    uint16_t bit=0;
-    uint32_t byte=0;
+    uint32_t hash[4];
 
-    HTFileVersioning::discoverHighLow(fname, out);
-    HTFileVersioning::from3WtoIndex(out, &byte, &bit);
+    HTFileVersioning::hashFile(fname, hash, this->family);
+    return this->checkHash(hash);
+}
 
-    return bool(
-        (this->dwhashtable[byte]) & bit
-    );
+void HTFileVersioning::addFiles(const char * const *fnames, size_t n)
+{
+    uint32_t hashes[2][prefetchWindow][4];
+
+    // Files are hashed prefetchWindow at once, and their places prefetched,
+    // a window ahead of the ones being added
+    if (n)
+        this->hashWindow(fnames, n, hashes[0], true);
+    for (size_t i=0, w=0; i<n; i+=prefetchWindow, w^=1) {
+        if (i+prefetchWindow < n)
+            this->hashWindow(fnames+i+prefetchWindow, n-i-prefetchWindow,
+                hashes[w^1], true);
+        for (size_t k=0; k<prefetchWindow && i+k<n; ++k)
+            this->addHash(hashes[w][k]);
+    }
+    if (this->fingerprinted)
+        this->compactFingerprints();
+}
+
+void HTFileVersioning::checkFiles(const char * const *fnames, size_t n,
+    uint8_t *results) const
+{
+    uint32_t hashes[2][prefetchWindow][4];
+
+    // Files are hashed prefetchWindow at once, and their places prefetched,
+    // a window ahead of the ones being checked
+    if (n)
+        this->hashWindow(fnames, n, hashes[0], false);
+    for (size_t i=0, w=0; i<n; i+=prefetchWindow, w^=1) {
+        if (i+prefetchWindow < n)
+            this->hashWindow(fnames+i+prefetchWindow, n-i-prefetchWindow,
+                hashes[w^1], false);
+        for (size_t k=0; k<prefetchWindow && i+k<n; ++k)
+            results[i+k] = this->checkHash(hashes[w][k]);
+    }
+}
+
+void HTFileVersioning::hashWindow(const char * const *fnames, size_t n,
+    uint32_t (*hashes)[4], bool write) const
+{
+    if (n > prefetchWindow)
+        n = prefetchWindow;
+    if (this->family == HASH_ONE_AT_TIME)
+        HTFileVersioning::hashFiles(fnames, n, hashes[0]);
+    else
+        for (size_t k=0; k<n; ++k)
+            HTFileVersioning::hashFile(fnames[k], hashes[k], this->family);
+    for (size_t k=0; k<n; ++k)
+        this->prefetchHash(hashes[k], write);
 }
 
 
@@ -247,51 +1463,195 @@ void HTFileVersioning::getRawHTable(void *place, size_t len) const
 }
 
 std::string HTFileVersioning::getHTable(void) const
+{
+    return HTFileVersioning::encodeHTable(this->shashtable,
+        this->getHTableBytesLen(), this->probes, this->bits, this->layout,
+        kindBits, this->family, this->index);
+}
+
+std::string HTFileVersioning::encodeHTable(const uint8_t *payload,
+    size_t payload_len, uint8_t probes, uint64_t bits, Layout layout,
+    uint8_t kind, HashFamily family, Index index, HTDataCompress::Codec codec)
 {
     size_t len;
     uint8_t *out = NULL;
     size_t out_len = 0;
 
-    HTDataCompress::compress(this->shashtable, this->getHTableBytesLen(), &out, &out_len);
+    // Legacy tables go without header, older versions can still read them,
+    // so they keep the fixed width codes
+    bool legacy = probes == 1 && bits == legacyBitsLen &&
+        layout == LAYOUT_FLAT && kind == kindBits &&
+        family == HASH_ONE_AT_TIME && index == INDEX_NIBBLES;
+    if (legacy)
+        codec = HTDataCompress::CODEC_LZW;
+    codec = HTDataCompress::compress((uint8_t*)payload, payload_len, &out,
+        &out_len, codec);
+
+    std::vector<uint8_t> blob;
+    if (!legacy) {
+        blob.push_back(headerMagic);
+        blob.push_back(headerVersion);
+        blob.push_back(probes);
+        for (uint8_t b=0; b<64; b+=8)
+            blob.push_back(uint8_t(bits>>b));
+        blob.push_back(layout);
+        blob.push_back(kind);
+        blob.push_back(family);
+        blob.push_back(index);
+        blob.push_back(codec);
+        blob.resize(headerLen);
+    }
+    blob.insert(blob.end(), out, out+out_len);
+
+    // The checksum covers the whole blob but itself
+    if (!blob.empty() && blob[0] == headerMagic) {
+        uint32_t crc = HTKernels::crc32c(blob.data(), headerCrcAt);
+        crc = HTKernels::crc32c(blob.data()+headerLen, out_len, crc);
+        for (uint8_t b=0; b<4; ++b)
+            blob[headerCrcAt+b] = uint8_t(crc>>(b*8));
+    }
 
     HT_B64 b64_encoder;
     unsigned char * ptr = b64_encoder.base64_encode(
-        out,
-        out_len,
+        &blob[0],
+        blob.size(),
         &len
     );
 
     std::string ret((const char*)ptr, len);
 
-    delete ptr;
-    delete out;
+    delete[] ptr;
+    delete[] out;
     return ret;
 }
 
-void HTFileVersioning::setHTable(std::string str) 
+void HTFileVersioning::decodeHTable(const std::string &str,
+    std::vector<uint8_t> &raw, uint8_t *probes, uint64_t *bits, Layout *layout,
+    uint8_t *kind, HashFamily *family, Index *index)
 {
-    size_t len = getHTableBytesLen()*3;
-    uint8_t *temp = new uint8_t[len]();
+    std::vector<uint8_t> blob;
+    HashFamily hashed;
+    Index indexed;
+    HTDataCompress::Codec codec;
+
+    size_t skip = HTFileVersioning::decodeHeader(str, blob, probes, bits,
+        layout, kind, &hashed, &indexed, &codec);
+    if (family)
+        (*family) = hashed;
+    if (index)
+        (*index) = indexed;
+    HTFileVersioning::decodePayload(blob, skip, codec, *bits, *kind, raw);
+}
 
-    bzero(temp, len);
-    bzero(this->hashtable, HTFileVersioning::getHTableBytesLen());
+size_t HTFileVersioning::decodeHeader(const std::string &str,
+    std::vector<uint8_t> &blob, uint8_t *probes, uint64_t *bits,
+    Layout *layout, uint8_t *kind, HashFamily *family, Index *index,
+    HTDataCompress::Codec *codec)
+{
+    size_t len = str.size()/4*3;
+    if (!len)
+        throw "Bad encoded table";
+    blob.resize(len);
 
     HT_B64 b64_encoder;
-    b64_encoder.base64_decode(
+    if (!b64_encoder.base64_decode(
         (const unsigned char*)str.c_str(),
         str.size(),
         &len,
-        temp
-    );
+        &blob[0]
+    ))
+        throw "Bad encoded table";
+    blob.resize(len);
+
+    // The first byte of a headerless table is the LZW code width, which
+    // never reaches headerMagic
+    size_t skip = 0;
+    (*probes) = 1;
+    (*bits) = legacyBitsLen;
+    (*layout) = LAYOUT_FLAT;
+    (*kind) = kindBits;
+    (*family) = HASH_ONE_AT_TIME;
+    (*index) = INDEX_NIBBLES;
+    (*codec) = HTDataCompress::CODEC_LZW;
+    if (blob[0] == headerMagic) {
+        if (len < headerLen || blob[1] != headerVersion)
+            throw "Bad table header";
+        (*probes) = blob[2];
+        (*bits) = 0;
+        for (uint8_t b=0; b<8; ++b)
+            (*bits) |= uint64_t(blob[3+b])<<(b*8);
+        (*layout) = Layout(blob[11]);
+        (*kind) = blob[12];
+        (*family) = HashFamily(blob[13]);
+        (*index) = Index(blob[14]);
+        (*codec) = HTDataCompress::Codec(blob[15]);
+
+        uint32_t crc = 0;
+        for (uint8_t b=0; b<4; ++b)
+            crc |= uint32_t(blob[headerCrcAt+b])<<(b*8);
+        uint32_t check = HTKernels::crc32c(&blob[0], headerCrcAt);
+        check = HTKernels::crc32c(&blob[headerLen], len-headerLen, check);
+        if (crc != check)
+            throw "Bad table checksum";
+        if (!(*probes) || (*probes) > maxProbes || !(*bits) ||
+            (*bits) > maxBitsLen || (*layout) > LAYOUT_BLOCKED ||
+            (*kind) > kindExact || (*family) > HASH_WYHASH ||
+            (*index) > INDEX_WIDE)
+            throw "Bad table header";
+        if (!HTDataCompress::hasCodec(*codec))
+            throw "Unknown table codec";
+        skip = headerLen;
+    }
+    return skip;
+}
 
-    HTDataCompress::decompress(temp, len, this->shashtable, getHTableBytesLen());
+void HTFileVersioning::decodePayload(const std::vector<uint8_t> &blob,
+    size_t skip, HTDataCompress::Codec codec, uint64_t bits, uint8_t kind,
+    std::vector<uint8_t> &raw)
+{
+    // Counting tables carry 4 bits per position, the others bits is their
+    // payload size
+    raw.resize(divRoundUp(bits, kind == kindCounting ? 2 : 8));
+    HTDataCompress::decompress((uint8_t*)blob.data()+skip, blob.size()-skip,
+        &raw[0], raw.size(), codec);
+}
 
-    delete temp;
+void HTFileVersioning::setHTable(std::string str)
+{
+    uint8_t probes, kind;
+    uint64_t bits;
+    Layout layout;
+    std::vector<uint8_t> blob, raw;
+
+    HashFamily family;
+    Index index;
+    HTDataCompress::Codec codec;
+    size_t skip = HTFileVersioning::decodeHeader(str, blob, &probes, &bits,
+        &layout, &kind, &family, &index, &codec);
+    if (kind != kindBits)
+        throw "Not a bit table";
+
+    // Payloads listing their bits are checked first, then set straight
+    // into the table configure zeroed, the others go through raw
+    bool listed = HTDataCompress::orBits(blob.data()+skip,
+        blob.size()-skip, NULL, bits, codec);
+    if (!listed)
+        HTFileVersioning::decodePayload(blob, skip, codec, bits, kind, raw);
+
+    this->detachFingerprints();
+    this->configure(probes, bits, layout, index);
+    this->family = family;
+    if (listed)
+        HTDataCompress::orBits(blob.data()+skip, blob.size()-skip,
+            this->shashtable, bits, codec);
+    else
+        memcpy(this->hashtable, &raw[0], raw.size());
 }
 
 void HTFileVersioning::setHTable(void *place, size_t len)
 {
-    bzero(this->hashtable, HTFileVersioning::getHTableBytesLen());
+    this->detachFingerprints();
+    bzero(this->hashtable, getHTableBytesLen());
 
     size_t t = len;
     if (t > getHTableBytesLen())
@@ -301,32 +1661,312 @@ void HTFileVersioning::setHTable(void *place, size_t len)
 
 void HTFileVersioning::mergeHTable(std::string str)
 {
-    size_t len = HTFileVersioning::getHTableBytesLen()*3;
-    size_t len2 = HTFileVersioning::getHTableBytesLen();
-    unsigned char *buffer = new unsigned char[len]();
-    unsigned char *buffer2 = new unsigned char[len2]();
+    uint8_t probes, kind;
+    uint64_t bits;
+    Layout layout;
+    std::vector<uint8_t> blob, raw;
+
+    HashFamily family;
+    Index index;
+    HTDataCompress::Codec codec;
+    size_t skip = HTFileVersioning::decodeHeader(str, blob, &probes, &bits,
+        &layout, &kind, &family, &index, &codec);
+
+    if (kind != kindBits)
+        throw "Not a bit table";
+    if (probes != this->probes || bits != this->bits ||
+        layout != this->layout || index != this->index)
+        throw "Table geometry mismatch";
+    if (family != this->family)
+        throw "Hash family mismatch";
+
+    // Payloads listing their bits are set straight into the table
+    if (HTDataCompress::orBits(blob.data()+skip, blob.size()-skip,
+        this->shashtable, this->bits, codec)) {
+        this->detachFingerprints();
+        return;
+    }
+    HTFileVersioning::decodePayload(blob, skip, codec, bits, kind, raw);
+    this->mergeHTable(&raw[0], raw.size());
+}
 
-    bzero(buffer, len);
-    bzero(buffer2, len2);
+void HTFileVersioning::mergeHTable(void *place, size_t len)
+{
+    this->combineHTable(place, len, HTKernels::OP_OR);
+}
 
-    HT_B64 b64_encoder;
-    b64_encoder.base64_decode(
-        (const unsigned char*)str.c_str(),
-        str.size(),
-        &len,
-        buffer
-    );
+void HTFileVersioning::intersectHTable(void *place, size_t len)
+{
+    this->combineHTable(place, len, HTKernels::OP_AND);
+}
+
+void HTFileVersioning::xorHTable(void *place, size_t len)
+{
+    this->combineHTable(place, len, HTKernels::OP_XOR);
+}
 
-    HTDataCompress::decompress(buffer, len, buffer2, len2);
-    this->mergeHTable(buffer2, len2);
+void HTFileVersioning::subtractHTable(void *place, size_t len)
+{
+    this->combineHTable(place, len, HTKernels::OP_ANDNOT);
+}
 
-    delete buffer;
-    delete buffer2;
+void HTFileVersioning::mergeHTables(const HTFileVersioning * const *tables,
+    size_t n)
+{
+    this->combineHTables(tables, n, HTKernels::OP_OR);
 }
 
-void HTFileVersioning::mergeHTable(void *place, size_t len)
+void HTFileVersioning::intersectHTables(const HTFileVersioning * const *tables,
+    size_t n)
 {
-    unsigned char* buffer = (unsigned char*)place;
-    for (unsigned int i=0; i<len; i++)
-        this->chashtable[i] |= buffer[i];
-}
\ No newline at end of file
+    this->combineHTables(tables, n, HTKernels::OP_AND);
+}
+
+void HTFileVersioning::xorHTables(const HTFileVersioning * const *tables,
+    size_t n)
+{
+    this->combineHTables(tables, n, HTKernels::OP_XOR);
+}
+
+void HTFileVersioning::subtractHTables(const HTFileVersioning * const *tables,
+    size_t n)
+{
+    this->combineHTables(tables, n, HTKernels::OP_ANDNOT);
+}
+
+void HTFileVersioning::combineHTable(void *place, size_t len, int op)
+{
+    if (len != this->getHTableBytesLen())
+        throw "Table size mismatch";
+
+    const uint8_t *src = (const uint8_t*)place;
+    HTKernels::combine(this->shashtable, &src, 1, len, HTKernels::Op(op));
+    this->detachFingerprints();
+}
+
+void HTFileVersioning::combineHTables(const HTFileVersioning * const *tables,
+    size_t n, int op)
+{
+    std::vector<const uint8_t*> srcs(n);
+
+    for (size_t i=0; i<n; ++i) {
+        if (tables[i]->probes != this->probes ||
+            tables[i]->bits != this->bits ||
+            tables[i]->layout != this->layout ||
+            tables[i]->index != this->index)
+            throw "Table geometry mismatch";
+        if (tables[i]->family != this->family)
+            throw "Hash family mismatch";
+        srcs[i] = tables[i]->shashtable;
+    }
+
+    if (!n)
+        return;
+    HTKernels::combine(this->shashtable, &srcs[0], n,
+        this->getHTableBytesLen(), HTKernels::Op(op));
+
+    // A union keeps the fingerprints when every table has them, the other
+    // operations leave bits no fingerprint set describes
+    bool keep = this->fingerprinted && op == HTKernels::OP_OR;
+    for (size_t i=0; i<n && keep; ++i)
+        keep = tables[i]->fingerprinted;
+    if (!keep) {
+        this->detachFingerprints();
+        return;
+    }
+
+    std::vector<uint32_t> fps;
+    for (size_t i=0; i<n; ++i) {
+        fps.insert(fps.end(), tables[i]->sortedFps.begin(),
+            tables[i]->sortedFps.end());
+        fps.insert(fps.end(), tables[i]->tailFps.begin(),
+            tables[i]->tailFps.end());
+    }
+    this->tailFps.insert(this->tailFps.end(), fps.begin(), fps.end());
+    this->compactFingerprints();
+}
+
+const uint8_t HTCountingFileVersioning::counterMax;
+
+HTCountingFileVersioning::HTCountingFileVersioning(void):
+    HTFileVersioning(), counters(NULL)
+{
+    this->allocCounters();
+}
+
+HTCountingFileVersioning::HTCountingFileVersioning(uint64_t bits):
+    HTFileVersioning(bits), counters(NULL)
+{
+    this->allocCounters();
+}
+
+HTCountingFileVersioning::HTCountingFileVersioning(uint64_t expected_items,
+    double fpr, Layout layout):
+    HTFileVersioning(expected_items, fpr, layout), counters(NULL)
+{
+    this->allocCounters();
+}
+
+HTCountingFileVersioning::~HTCountingFileVersioning()
+{
+    free(this->counters);
+}
+
+void HTCountingFileVersioning::allocCounters(void)
+{
+    void *table = NULL;
+    size_t len = this->getCountersBytesLen();
+
+    if (posix_memalign(&table, 64, len))
+        throw std::bad_alloc();
+    bzero(table, len);
+
+    free(this->counters);
+    this->counters = (uint8_t*)table;
+}
+
+void HTCountingFileVersioning::reset(void)
+{
+    HTFileVersioning::reset();
+    bzero(this->counters, this->getCountersBytesLen());
+}
+
+void HTCountingFileVersioning::collapse(void)
+{
+    HTKernels::countersToBits(this->shashtable, this->counters,
+        this->getCountersBytesLen());
+}
+
+void HTCountingFileVersioning::checkGeometry(
+    const HTCountingFileVersioning &table) const
+{
+    if (table.probes != this->probes || table.bits != this->bits ||
+        table.layout != this->layout || table.index != this->index)
+        throw "Table geometry mismatch";
+    if (table.family != this->family)
+        throw "Hash family mismatch";
+}
+
+void HTCountingFileVersioning::addFile(const char *fname)
+{
+    uint32_t hash[4];
+    uint64_t pos[maxProbes];
+
+    HTFileVersioning::hashFile(fname, hash, this->family);
+    uint8_t n = this->probePositions(hash, pos);
+    for (uint8_t p=0; p<n; ++p) {
+        uint8_t &c = this->counters[pos[p]>>1];
+        uint8_t shift = (pos[p]&1)*4;
+
+        if (((c>>shift)&0xF) < counterMax)
+            c += 1<<shift;
+        this->setBit(pos[p]);
+    }
+}
+
+bool HTCountingFileVersioning::removeFile(const char *fname)
+{
+    uint32_t hash[4];
+    uint64_t pos[maxProbes];
+
+    HTFileVersioning::hashFile(fname, hash, this->family);
+    if (!this->checkHash(hash))
+        return false;
+
+    uint8_t n = this->probePositions(hash, pos);
+    for (uint8_t p=0; p<n; ++p) {
+        uint8_t &c = this->counters[pos[p]>>1];
+        uint8_t shift = (pos[p]&1)*4;
+        uint8_t count = (c>>shift)&0xF;
+
+        // Probes may repeat a position, it was counted once for each
+        if (!count || count == counterMax)
+            continue;
+        c -= 1<<shift;
+        if (count == 1)
+            this->qhashtable[pos[p]>>6] &= ~(uint64_t(1)<<(pos[p]&63));
+    }
+    return true;
+}
+
+std::string HTCountingFileVersioning::getHTable(void) const
+{
+    return HTFileVersioning::encodeHTable(this->counters,
+        divRoundUp(this->bits, 2), this->probes, this->bits, this->layout,
+        kindCounting, this->family, this->index);
+}
+
+void HTCountingFileVersioning::setHTable(std::string str)
+{
+    uint8_t probes, kind;
+    uint64_t bits;
+    Layout layout;
+    std::vector<uint8_t> blob, raw;
+
+    HashFamily family;
+    Index index;
+    HTDataCompress::Codec codec;
+    size_t skip = HTFileVersioning::decodeHeader(str, blob, &probes, &bits,
+        &layout, &kind, &family, &index, &codec);
+    if (kind != kindCounting)
+        throw "Not a counting table";
+    HTFileVersioning::decodePayload(blob, skip, codec, bits, kind, raw);
+
+    bool realloc = bits != this->bits;
+    this->configure(probes, bits, layout, index);
+    this->family = family;
+    if (realloc)
+        this->allocCounters();
+    else
+        bzero(this->counters, this->getCountersBytesLen());
+    memcpy(this->counters, &raw[0], raw.size());
+    // An odd number of counters leaves a stray nibble
+    if (bits&1)
+        this->counters[bits>>1] &= 0xF;
+    this->collapse();
+}
+
+void HTCountingFileVersioning::mergeHTable(std::string str)
+{
+    uint8_t probes, kind;
+    uint64_t bits;
+    Layout layout;
+    std::vector<uint8_t> blob, raw;
+
+    HashFamily family;
+    Index index;
+    HTDataCompress::Codec codec;
+    size_t skip = HTFileVersioning::decodeHeader(str, blob, &probes, &bits,
+        &layout, &kind, &family, &index, &codec);
+
+    if (kind != kindCounting)
+        throw "Not a counting table";
+    if (probes != this->probes || bits != this->bits ||
+        layout != this->layout || index != this->index)
+        throw "Table geometry mismatch";
+    if (family != this->family)
+        throw "Hash family mismatch";
+    HTFileVersioning::decodePayload(blob, skip, codec, bits, kind, raw);
+    if (bits&1)
+        raw[bits>>1] &= 0xF;
+    HTKernels::counterAdd(this->counters, &raw[0], raw.size());
+    this->collapse();
+}
+
+void HTCountingFileVersioning::mergeHTable(
+    const HTCountingFileVersioning &table)
+{
+    this->checkGeometry(table);
+    HTKernels::counterAdd(this->counters, table.counters,
+        this->getCountersBytesLen());
+    this->collapse();
+}
+
+void HTCountingFileVersioning::subtractHTable(
+    const HTCountingFileVersioning &table)
+{
+    this->checkGeometry(table);
+    HTKernels::counterSub(this->counters, table.counters,
+        this->getCountersBytesLen());
+    this->collapse();
+}
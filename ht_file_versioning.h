@@ -3,14 +3,43 @@
 
 #include <string>
 #include <stdint.h>
+#include <vector>
+#include <atomic>
+#include "one_at_time.hpp"
 
 ////////////////////////////////////////////////////////////////////////////////
 /// \brief Symetric compression.
 ///
-/// This class is used to compress buffers using LZMA algorithm.
+/// This class is used to compress buffers, with any of the registered
+/// codecs (LZMA when built with HT_WITH_LZMA).
 ////////////////////////////////////////////////////////////////////////////////
 class HTDataCompress {
     public:
+        /// \brief Payload codecs.
+        ///
+        /// How the payload of an exported table is compressed, recorded in
+        /// its header.
+        enum Codec {
+            CODEC_LZW = 0,     ///< LZW codes packed at the width of the largest
+            CODEC_LZW_VAR = 1, ///< LZW codes growing from 9 bits with the
+                               ///< dictionary, which is cleared when full
+            CODEC_RAW = 2,     ///< The buffer as is
+            CODEC_RLE0 = 3,    ///< Runs of zero bytes between literals
+            CODEC_SPARSE = 4,  ///< Gaps between the bits set, as varints
+            CODEC_LZMA = 5,    ///< liblzma (xz), built with HT_WITH_LZMA
+            CODEC_RICE = 6,    ///< Gaps between the bits set, Golomb-Rice
+                               ///< coded
+            CODEC_AUTO = 255   ///< Compress only: the smallest of the linear
+                               ///< codecs and of those that fit in the budget
+        };
+
+        static const uint32_t lzwClear = 256;        ///< Clear code (CODEC_LZW_VAR)
+        static const uint8_t lzwVarMaxBits = 20;     ///< Widest code written
+        static const uint8_t lzwVarMaxBitsLimit = 24; ///< Widest code read
+        static const uint32_t autoBudgetUs = 50000;  ///< Estimated time CODEC_AUTO may take
+        static const uint32_t lzmaPreset = 6;        ///< CODEC_LZMA level
+        static const uint8_t riceMaxK = 48;          ///< Widest Rice remainder
+
         /// \brief Compresss function.
         ///
         /// Compress the given input buffer and returns its output and size.
@@ -20,8 +49,14 @@ class HTDataCompress {
         /// \param out a pointer to pointer, allowing retrieve the pointer to
         /// the the new compressed buffer.
         /// \param out_len the compressed size.
-        static void compress(uint8_t *in, size_t in_len, uint8_t **out,
-            size_t *out_len);
+        /// \param codec the codec to use, CODEC_AUTO to pick the smallest.
+        /// \param budget_us with CODEC_AUTO, the microseconds the slower
+        /// codecs may take, estimated from in_len: those expected to run past
+        /// it are skipped. The linear codecs are always tried.
+        /// \return the codec used.
+        static Codec compress(uint8_t *in, size_t in_len, uint8_t **out,
+            size_t *out_len, Codec codec=CODEC_LZW,
+            uint32_t budget_us=autoBudgetUs);
 
         /// \brief Decompress function.
         ///
@@ -32,15 +67,111 @@ class HTDataCompress {
         /// \param out a pointer to pointer, allowing retrieve the pointer to
         /// the the new uncompressed buffer.
         /// \param out_len the uncompressed size.
+        /// \param codec the codec in was compressed with.
         static void decompress(uint8_t *in, size_t in_len, uint8_t *out,
-            size_t out_len);
+            size_t out_len, Codec codec=CODEC_LZW);
+
+        /// \brief Checks for a codec.
+        ///
+        /// \param codec the codec to look for.
+        /// \return true when codec is registered (and built in).
+        static bool hasCodec(Codec codec);
+
+        /// \brief Sets the bits listed by a payload.
+        ///
+        /// ORs the bits set in a CODEC_SPARSE or CODEC_RICE payload into
+        /// out, in time proportional to the bits set and without
+        /// decompressing to a buffer first. The whole payload is checked
+        /// before out is touched.
+        ///
+        /// \param in the pointer to input buffer.
+        /// \param in_len the size of the input buffer.
+        /// \param out the bits to set, not cleared, NULL to only check in.
+        /// \param nbits the size of out in bits, a position past it throws.
+        /// \param codec the codec in was compressed with.
+        /// \return false, leaving out alone, when codec does not list bits.
+        static bool orBits(const uint8_t *in, size_t in_len, uint8_t *out,
+            uint64_t nbits, Codec codec);
 
     protected:
+        /// \brief A registered codec.
+        struct CodecEntry {
+            Codec codec;        ///< Id of the codec, written in headers
+            void (*compress)(const uint8_t *in, size_t in_len,
+                std::vector<uint8_t> &out);  ///< Appends in compressed to out
+            void (*decompress)(const uint8_t *in, size_t in_len,
+                uint8_t *out, size_t out_len); ///< Fills out (zeroed) with in
+            void (*orBits)(const uint8_t *in, size_t in_len,
+                uint8_t *out, uint64_t nbits); ///< ORs the bits listed in
+                                               ///< into out, NULL if none
+            uint32_t psPerByte; ///< Compress cost, for CODEC_AUTO (0: never)
+            bool linear;        ///< CODEC_AUTO tries it whatever the budget
+        };
+
+        static const CodecEntry codecs[]; ///< Registered, cheapest first
+
+        /// \brief Looks up a codec.
+        ///
+        /// \param codec the codec to look for.
+        /// \return the codec entry, NULL if codec is not registered.
+        static const CodecEntry *findCodec(Codec codec);
+
+        static void lzwCompress(const uint8_t *in, size_t in_len,
+            std::vector<uint8_t> &out);
+        static void lzwDecompress(const uint8_t *in, size_t in_len,
+            uint8_t *out, size_t out_len);
+        static void lzwVarCompress(const uint8_t *in, size_t in_len,
+            std::vector<uint8_t> &out);
+        static void lzwVarDecompress(const uint8_t *in, size_t in_len,
+            uint8_t *out, size_t out_len);
+
+        /// \brief LZW codes of a buffer.
+        ///
+        /// The dictionary is a flat hash table of (prefix code, byte)
+        /// entries, allocated once for the whole buffer.
+        ///
+        /// \param uncompressed the buffer to compress.
+        /// \param size the size of the buffer.
+        /// \param result where to write the codes.
+        /// \param first first code of the strings added to the dictionary.
+        /// \param max_bits when not 0, the dictionary is cleared (writing
+        /// lzwClear) once it holds 2^max_bits codes.
+        /// \return result past the last code.
         template < typename Iterator >
-        static Iterator lzw_compress(const char *uncompressed, uint32_t size,
-            Iterator result);
-        template < typename Iterator >
-        static std::string lzw_decompress(Iterator begin, Iterator end);
+        static Iterator lzw_compress(const char *uncompressed, size_t size,
+            Iterator result, uint32_t first=256, uint8_t max_bits=0);
+
+        /// \brief Decodes fixed width LZW codes.
+        ///
+        /// The dictionary is an array of (prefix code, byte) entries,
+        /// allocated once for all the codes, each string is written
+        /// straight to out. Codes are unpacked from in a chunk at a time,
+        /// into a buffer on the stack.
+        ///
+        /// \param in packed codes.
+        /// \param n number of codes.
+        /// \param width bits per code, 1 to 32.
+        /// \param out where to write the decoded bytes.
+        /// \param out_len size of out, the bytes past it are dropped.
+        /// \return the number of decoded bytes.
+        static uint64_t lzw_decompress(const uint8_t *in, size_t n,
+            uint8_t width, uint8_t *out, size_t out_len);
+
+        /// \brief Decodes variable width LZW codes.
+        ///
+        /// The j-th code after a clear takes as many bits as the largest
+        /// code the dictionary may hold by then, from 9 up to max_bits.
+        /// Codes are read straight from in.
+        ///
+        /// \param in packed codes.
+        /// \param in_len size of in.
+        /// \param max_bits widest code, 0 when the dictionary is never
+        /// cleared.
+        /// \param out where to write the decoded bytes.
+        /// \param out_len size of out, the bytes past it are dropped.
+        /// \return the number of decoded bytes.
+        static uint64_t lzw_decompress_var(const uint8_t *in, size_t in_len,
+            uint8_t max_bits, uint8_t *out, size_t out_len);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -51,30 +182,209 @@ class HTDataCompress {
 ////////////////////////////////////////////////////////////////////////////////
 class HTFileVersioning {
     public:
-        static uint8_t bklenght; ///< The lenght in bits of the hash key
+        /// \brief Table layouts.
+        ///
+        /// How the probes of a file are spread over the table.
+        enum Layout {
+            LAYOUT_FLAT = 0,    ///< Probes anywhere in the table
+            LAYOUT_BLOCKED = 1  ///< All probes inside one 64 bytes block
+        };
+
+        /// \brief Index derivations.
+        ///
+        /// How the hash of a file becomes the positions it probes. Exported
+        /// tables record it, tables of different derivations never mix.
+        enum Index {
+            /// v1, 3 nibbles of the folded hash, only reaches 241 of the 256
+            /// words of single probe 4096 bits tables (headerless exports)
+            INDEX_NIBBLES = 0,
+            /// v2, enhanced double hashing over 64b, each probe reduced with
+            /// a multiply-shift, uniform up to maxBitsLen
+            INDEX_WIDE = 1
+        };
+
+        /// \brief Hash families.
+        ///
+        /// How file paths are hashed. Exported tables record it, tables of
+        /// different families never mix.
+        enum HashFamily {
+            HASH_ONE_AT_TIME = 0, ///< Bucked one at time, a byte per step
+            HASH_CRC32C = 1,      ///< Two CRC32C, 8 bytes per step (SSE4.2),
+                                  ///< 64 bits of state
+            HASH_WYHASH = 2       ///< wyhash, 16 bytes per multiply
+        };
+
+        static const uint64_t blockBitsLen = 512;        ///< Bits per block
+        static const uint64_t legacyBitsLen = 4096;      ///< Default table size
+        static const uint64_t maxBitsLen = uint64_t(1)<<40; ///< Max table size
+        static const uint8_t maxProbes = 32; ///< Max number of probes per file
 
         /// \brief Returns the size of the table.
         ///
         /// Returns the size (in bits) of the hash table.
         ///
         /// \return number of bits of the hash table.
-        static uint64_t getHTableBitsLen(void)
+        uint64_t getHTableBitsLen(void) const
         {
-            return 1<<(bklenght);
+            return this->bits;
         }
         /// \brief Returns the size of the table.
         ///
         /// Returns the size (in bytes) of the hash table.
         ///
         /// \return number of bytes of the hash table.
-        static uint32_t getHTableBytesLen(void)
+        uint64_t getHTableBytesLen(void) const
         {
             return divRoundUp(getHTableBitsLen(), 8);
         }
+        /// \brief Returns the number of probes.
+        ///
+        /// Returns how many bits are set (and tested) for each file.
+        ///
+        /// \return number of probes per file.
+        uint8_t getProbes(void) const
+        {
+            return this->probes;
+        }
+        /// \brief Returns the layout.
+        ///
+        /// Returns how the probes of a file are spread over the table.
+        ///
+        /// \return the table layout.
+        Layout getLayout(void) const
+        {
+            return this->layout;
+        }
+        /// \brief Returns the index derivation.
+        ///
+        /// \return INDEX_NIBBLES for legacy tables (default constructor or
+        /// headerless exports), INDEX_WIDE for new sized tables.
+        Index getIndex(void) const
+        {
+            return this->index;
+        }
+        /// \brief Sets the concurrent mode.
+        ///
+        /// In concurrent mode many threads may call addFile/addFiles and
+        /// checkFile/checkFiles at the same time on this table. Inserts use
+        /// relaxed atomic fetch_or on 64b words and checks use relaxed loads,
+        /// so a check concurrent to an insert may or may not see it. Other
+        /// calls (reset, set, merge) still need exclusive access.
+        ///
+        /// \param concurrent true to enable the concurrent mode.
+        void setConcurrent(bool concurrent)
+        {
+            if (concurrent && this->fingerprinted)
+                throw "Fingerprints need a single writer";
+            this->concurrent = concurrent;
+        }
+        /// \brief Returns the concurrent mode.
+        ///
+        /// \return true if the concurrent mode is enabled.
+        bool isConcurrent(void) const
+        {
+            return this->concurrent;
+        }
 
+        /// \brief Attaches or drops the fingerprints side table.
+        ///
+        /// With the side table, every file added also keeps a 32b
+        /// fingerprint, and files found on the table are confirmed on the
+        /// fingerprints, so checks have (nearly) no false positives. Files
+        /// not found never reach the side table. The side table is never
+        /// exported, getHTable stays the plain table.
+        ///
+        /// Can only be enabled on an empty table, out of concurrent mode.
+        /// Setting, merging or combining with raw or exported tables drops
+        /// the side table, their files have no fingerprints.
+        ///
+        /// \param enabled true to attach the side table.
+        void setFingerprints(bool enabled);
+        /// \brief Returns if the fingerprints side table is attached.
+        bool hasFingerprints(void) const
+        {
+            return this->fingerprinted;
+        }
+        /// \brief Returns the memory used by the fingerprints.
+        ///
+        /// \return number of bytes of the side table.
+        size_t getFingerprintsBytesLen(void) const
+        {
+            return (this->sortedFps.size() + this->tailFps.size())*
+                sizeof(uint32_t);
+        }
+
+        /// \brief Sets the hash family.
+        ///
+        /// How this table hashes file paths, HASH_ONE_AT_TIME by default.
+        /// Can only be changed on an empty table. Exported tables record
+        /// the family, setHTable adopts it and mergeHTable (or combining
+        /// tables) throws on a mismatch.
+        ///
+        /// \param family the hash family.
+        void setHashFamily(HashFamily family);
+        /// \brief Returns the hash family.
+        HashFamily getHashFamily(void) const
+        {
+            return this->family;
+        }
+
+        /// \brief Legacy constructor.
+        ///
+        /// Creates a single probe table with legacyBitsLen bits.
         HTFileVersioning(void);
+
+        /// \brief Sized constructor.
+        ///
+        /// Creates a single probe table with the given number of bits.
+        ///
+        /// \param bits size of the table in bits, up to maxBitsLen.
+        explicit HTFileVersioning(uint64_t bits);
+
+        /// \brief Bloom filter constructor.
+        ///
+        /// Creates a multi probe (Bloom filter) table, the size and the number
+        /// of probes are choosen to keep the false positive rate near to fpr
+        /// once expected_items files were added.
+        ///
+        /// With LAYOUT_BLOCKED all the probes of a file fall in the same 64
+        /// bytes block, so a check costs a single cache miss; the table gets
+        /// slightly bigger to keep the same false positive rate.
+        ///
+        /// \param expected_items number of files expected in the table.
+        /// \param fpr target false positive rate, in the (0, 1) range.
+        /// \param layout how the probes are spread over the table.
+        HTFileVersioning(uint64_t expected_items, double fpr,
+            Layout layout=LAYOUT_FLAT);
         ~HTFileVersioning();
 
+        /// \brief Count the bits set.
+        ///
+        /// \return number of bits set in the table.
+        uint64_t popcount(void) const;
+
+        /// \brief Returns how full the table is.
+        ///
+        /// \return the fraction of the (reachable) bits that are set.
+        double fillRatio(void) const;
+
+        /// \brief Estimates the number of files.
+        ///
+        /// Estimates how many distinct files were added from the bits set
+        /// (Swamidass-Baldi estimator), n = -(m/k)*ln(1 - X/m).
+        ///
+        /// \return the estimated number of files, infinity for a full table.
+        double estimatedItems(void) const;
+
+        /// \brief Estimates the false positive rate.
+        ///
+        /// Estimates the chance of checkFile returning true for a file never
+        /// added, from the bits currently set. On blocked tables each block
+        /// is weighted by its own fill.
+        ///
+        /// \return the estimated false positive rate.
+        double estimatedFpr(void) const;
+
         /// \brief Reset the table.
         ///
         /// Set all bits of the table to zero, effectively marking all files as
@@ -117,6 +427,76 @@ class HTFileVersioning {
         /// \return true if present, false otherwise.
         bool checkFile(const char *fname) const;
 
+        /// \brief Add many files.
+        ///
+        /// Same as calling addFile for each file, but the files are hashed
+        /// ahead, a window at once on SIMD lanes, and their places in the
+        /// table prefetched, hiding the memory latency of big tables.
+        ///
+        /// \param fnames array of null terminated c style strings.
+        /// \param n number of files in fnames.
+        void addFiles(const char * const *fnames, size_t n);
+
+        /// \brief Check many files.
+        ///
+        /// Same as calling checkFile for each file, but the files are hashed
+        /// ahead, a window at once on SIMD lanes, and their places in the
+        /// table prefetched, hiding the memory latency of big tables.
+        ///
+        /// \param fnames array of null terminated c style strings.
+        /// \param n number of files in fnames.
+        /// \param results array of n, where to store 1 if present, 0 otherwise.
+        void checkFiles(const char * const *fnames, size_t n,
+            uint8_t *results) const;
+
+        /// \brief Mark a hashed file on the table.
+        ///
+        /// Same as addFile, for a file already hashed by hashFile or by a
+        /// BuckedOneAtTimeHash state of 4 buckets (a path hashed in pieces,
+        /// resuming the state of its directory).
+        ///
+        /// \param hash 128b hash of the file.
+        void addHash(const uint32_t *hash);
+
+        /// \brief Mark a hashed file on the table.
+        ///
+        /// \param hash finalized hash of the file, of 4 buckets. Throws
+        /// unless the table hashes with HASH_ONE_AT_TIME.
+        void addHash(const Hash &hash)
+        {
+            if (hash.hash_size != 16)
+                throw "Bad hash size";
+            if (this->family != HASH_ONE_AT_TIME)
+                throw "Hash family mismatch";
+            this->addHash(hash.ihash);
+        }
+
+        /// \brief Check if a hashed file is marked on the table.
+        ///
+        /// Same as checkFile, for a file already hashed. Checks the bits,
+        /// than the fingerprints when attached.
+        ///
+        /// \param hash 128b hash of the file.
+        /// \return true if present, false otherwise.
+        bool checkHash(const uint32_t *hash) const
+        {
+            return this->checkBits(hash) && (!this->fingerprinted ||
+                this->checkFingerprint(HTFileVersioning::fingerprint(hash)));
+        }
+
+        /// \brief Check if a hashed file is marked on the table.
+        ///
+        /// \param hash finalized hash of the file, of 4 buckets.
+        /// \return true if present, false otherwise.
+        bool checkHash(const Hash &hash) const
+        {
+            if (hash.hash_size != 16)
+                throw "Bad hash size";
+            if (this->family != HASH_ONE_AT_TIME)
+                throw "Hash family mismatch";
+            return this->checkHash(hash.ihash);
+        }
+
         /// \brief Copy the raw table.
         ///
         /// Copy the raw table to *place respecting its size of len.
@@ -136,6 +516,8 @@ class HTFileVersioning {
         /// \brief Set the table.
         ///
         /// Decode and decompress the table in str, than set it as current table.
+        /// The size and the number of probes of the exported table are adopted
+        /// by this table.
         ///
         /// \param str Compressed and B64 encoded table
         void setHTable(std::string str);
@@ -151,19 +533,198 @@ class HTFileVersioning {
         /// \brief Merge table
         ///
         /// Decode and decompress the table in str, than merge with current
-        /// table.
+        /// table. Throws if the size or the number of probes differs.
         ///
         /// \param str Compressed and B64 encoded table
         void mergeHTable(std::string str);
 
-        /// \brief Set the table.
+        /// \brief Merge table
         ///
-        /// Merge raw table from place with current table.
+        /// Merge (OR) raw table from place with current table.
         ///
-        /// \param place Pointer to source of the raw table to copy
-        /// \param len sanity check limit of source
+        /// \param place Pointer to source of the raw table to merge
+        /// \param len size of source, must be getHTableBytesLen()
         void mergeHTable(void *place, size_t len);
 
+        /// \brief Intersect table
+        ///
+        /// Intersect (AND) raw table from place with current table.
+        ///
+        /// \param place Pointer to source of the raw table to intersect
+        /// \param len size of source, must be getHTableBytesLen()
+        void intersectHTable(void *place, size_t len);
+
+        /// \brief Symmetric difference of table
+        ///
+        /// XOR raw table from place with current table.
+        ///
+        /// \param place Pointer to source of the raw table to XOR
+        /// \param len size of source, must be getHTableBytesLen()
+        void xorHTable(void *place, size_t len);
+
+        /// \brief Subtract table
+        ///
+        /// Clear (AND-NOT) from current table the bits set on the raw table
+        /// from place.
+        ///
+        /// \param place Pointer to source of the raw table to subtract
+        /// \param len size of source, must be getHTableBytesLen()
+        void subtractHTable(void *place, size_t len);
+
+        /// \brief Merge many tables
+        ///
+        /// Merge (OR) n tables with current table, in a single pass over all
+        /// of them. Throws if the geometry of any table differs.
+        ///
+        /// \param tables array of n tables
+        /// \param n number of tables
+        void mergeHTables(const HTFileVersioning * const *tables, size_t n);
+
+        /// \brief Intersect many tables
+        ///
+        /// Intersect (AND) n tables with current table, in a single pass over
+        /// all of them. Throws if the geometry of any table differs.
+        ///
+        /// \param tables array of n tables
+        /// \param n number of tables
+        void intersectHTables(const HTFileVersioning * const *tables, size_t n);
+
+        /// \brief Symmetric difference of many tables
+        ///
+        /// XOR n tables with current table, in a single pass over all of them.
+        /// Throws if the geometry of any table differs.
+        ///
+        /// \param tables array of n tables
+        /// \param n number of tables
+        void xorHTables(const HTFileVersioning * const *tables, size_t n);
+
+        /// \brief Subtract many tables
+        ///
+        /// Clear from current table the bits set on any of the n tables, in a
+        /// single pass over all of them. Throws if the geometry of any table
+        /// differs.
+        ///
+        /// \param tables array of n tables
+        /// \param n number of tables
+        void subtractHTables(const HTFileVersioning * const *tables, size_t n);
+
+        static const uint8_t kindBits = 0;       ///< Exported bit table
+        static const uint8_t kindCounting = 1;   ///< Exported 4b counters
+        static const uint8_t kindCuckoo = 2;     ///< Exported cuckoo buckets
+        static const uint8_t kindFuse = 3;       ///< Exported fuse filter
+        static const uint8_t kindExact = 4;      ///< Exported fingerprint set
+
+        /// \brief Hash a file.
+        ///
+        /// Hash the filepath, every table index is derived from this hash.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \param hash 4 words where to store the 128b hash.
+        static void hashFile(const char *fname, uint32_t *hash);
+
+        /// \brief Hash a file with a hash family.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \param hash 4 words where to store the 128b hash.
+        /// \param family the hash family.
+        static void hashFile(const char *fname, uint32_t *hash,
+            HashFamily family);
+
+        /// \brief Hash many files.
+        ///
+        /// Same as calling hashFile for each file, but up to 16 files are
+        /// hashed at once on SIMD lanes.
+        ///
+        /// \param fnames array of null terminated c style strings.
+        /// \param n number of files in fnames.
+        /// \param hashes 4*n words where to store the 128b hashes.
+        static void hashFiles(const char * const *fnames, size_t n,
+            uint32_t *hashes);
+
+        /// \brief Derives two 64b hashes from a file hash.
+        ///
+        /// Mixes all 128b of the file hash into each half, so they can be
+        /// used as independent hashes.
+        ///
+        /// \param hash 128b hash of the file.
+        /// \param h1 where to store the first hash.
+        /// \param h2 where to store the second hash, always odd.
+        static void discoverProbes(const uint32_t *hash, uint64_t *h1,
+            uint64_t *h2);
+
+        /// \brief Encodes a table to export.
+        ///
+        /// Compress and B64 encode the payload, after a header with the
+        /// geometry of the table. Legacy bit tables go without header.
+        ///
+        /// \param payload the raw table to export.
+        /// \param payload_len size in bytes of payload.
+        /// \param probes number of probes (fingerprint bits for cuckoo).
+        /// \param bits size in bits of the table.
+        /// \param layout how the probes are spread over the table.
+        /// \param kind what payload carries (kindBits, kindCounting,
+        /// kindCuckoo, kindFuse, kindExact).
+        /// \param family hash family of the files.
+        /// \param index index derivation of the table.
+        /// \param codec how to compress the payload, legacy tables always
+        /// take CODEC_LZW.
+        /// \return std string with table compressed and encoded.
+        static std::string encodeHTable(const uint8_t *payload,
+            size_t payload_len, uint8_t probes, uint64_t bits, Layout layout,
+            uint8_t kind, HashFamily family=HASH_ONE_AT_TIME,
+            Index index=INDEX_WIDE,
+            HTDataCompress::Codec codec=HTDataCompress::CODEC_AUTO);
+
+        /// \brief Decodes an exported table.
+        ///
+        /// Decode the B64 string, read its header and decompress it.
+        ///
+        /// \param str Compressed and B64 encoded table.
+        /// \param raw where to store the raw table.
+        /// \param probes where to store the number of probes of the table.
+        /// \param bits where to store the size in bits of the table.
+        /// \param layout where to store the layout of the table.
+        /// \param kind where to store what the table carries (kindBits,
+        /// kindCounting, kindCuckoo, kindFuse, kindExact).
+        /// \param family where to store the hash family (if not NULL).
+        /// \param index where to store the index derivation (if not NULL).
+        static void decodeHTable(const std::string &str, std::vector<uint8_t> &raw,
+            uint8_t *probes, uint64_t *bits, Layout *layout, uint8_t *kind,
+            HashFamily *family=NULL, Index *index=NULL);
+
+        /// \brief Reads the header of an exported table.
+        ///
+        /// Decode the B64 string, read its header and verify its checksum,
+        /// without decompressing anything, so callers can reject tables
+        /// that do not fit before paying for it.
+        ///
+        /// \param str Compressed and B64 encoded table.
+        /// \param blob where to store the decoded blob.
+        /// \param probes where to store the number of probes of the table.
+        /// \param bits where to store the size in bits of the table.
+        /// \param layout where to store the layout of the table.
+        /// \param kind where to store what the table carries.
+        /// \param family where to store the hash family.
+        /// \param index where to store the index derivation.
+        /// \param codec where to store the codec of the payload.
+        /// \return offset of the payload in blob.
+        static size_t decodeHeader(const std::string &str,
+            std::vector<uint8_t> &blob, uint8_t *probes, uint64_t *bits,
+            Layout *layout, uint8_t *kind, HashFamily *family, Index *index,
+            HTDataCompress::Codec *codec);
+
+        /// \brief Decompress the payload of an exported table.
+        ///
+        /// \param blob the blob read by decodeHeader.
+        /// \param skip offset of the payload in blob.
+        /// \param codec codec of the payload.
+        /// \param bits size in bits of the table.
+        /// \param kind what the table carries.
+        /// \param raw where to store the raw table.
+        static void decodePayload(const std::vector<uint8_t> &blob,
+            size_t skip, HTDataCompress::Codec codec, uint64_t bits,
+            uint8_t kind, std::vector<uint8_t> &raw);
+
     protected:
         /// \brief All pointers to hashtable.
         ///
@@ -178,18 +739,345 @@ class HTFileVersioning {
             uint32_t *ihashtable;       ///! uint32_t pointer to hashtable
             uint16_t *dwhashtable;      ///! uint16_t pointer to hashtable
             uint8_t *shashtable;        ///! uint8_t pointer to hashtable
+            uint64_t *qhashtable;       ///! uint64_t pointer to hashtable
+            std::atomic<uint64_t> *ahashtable; ///! atomic pointer to hashtable
         };
 
-        static uint32_t divRoundUp(uint64_t a, uint32_t b)
+        uint64_t bits;  ///< Size in bits of this table
+        uint8_t probes; ///< Number of bits set for each file
+        Layout layout;  ///< How the probes are spread over the table
+        bool concurrent; ///< Use atomic operations on the table
+        bool fingerprinted; ///< Fingerprints side table attached
+        HashFamily family;  ///< How files are hashed
+        Index index;        ///< How hashes become positions
+
+        std::vector<uint32_t> sortedFps; ///< Sorted fingerprints
+        std::vector<uint32_t> tailFps;   ///< Fingerprints not yet sorted
+
+        /// Exported tables start with a header of headerLen bytes: magic,
+        /// version, probes, bits (64b little endian), layout, kind, hash
+        /// family, index derivation and codec of the table, then a CRC32C
+        /// (32b little endian) of the whole blob but the CRC32C itself.
+        static const uint8_t headerMagic = 'H';  ///< First byte of the header
+        static const uint8_t headerVersion = 2;  ///< Headerless tables are v1
+        static const uint8_t headerLen = 20;     ///< Header size in bytes
+        static const uint8_t headerCrcAt = 16;   ///< Offset of the checksum
+
+        static const size_t prefetchWindow = 8;  ///< Files hashed ahead
+        static const size_t tailFpsLen = 256;    ///< Min unsorted fingerprints
+        static const uint64_t legacyReachableBits = 241*16; ///< See from3WtoIndex
+
+        static uint64_t divRoundUp(uint64_t a, uint64_t b)
         {
-            uint32_t r = a/b;
+            uint64_t r = a/b;
             if(a%b) r++;
             return r;
         }
+
+        /// \brief Checks for legacy tables.
+        ///
+        /// Legacy tables (single probe and default size) keep the original
+        /// index derivation and are exported without header, so they can be
+        /// read by older versions.
+        ///
+        /// \return true if this table uses INDEX_NIBBLES.
+        bool isLegacy(void) const
+        {
+            return this->index == INDEX_NIBBLES;
+        }
+
+        /// \brief Returns the block probed by a hashed file.
+        ///
+        /// \param h1 first hash of the file.
+        /// \return index of the 64 bytes block.
+        uint64_t blockOf(uint64_t h1) const
+        {
+            uint64_t blocks = this->bits/blockBitsLen;
+            return uint64_t(((unsigned __int128)h1*blocks)>>64);
+        }
+
+        /// \brief Returns a probe of a flat table and steps to the next.
+        ///
+        /// \param h1 walk state, starts as the first hash of the file.
+        /// \param h2 walk state, starts as the second hash of the file.
+        /// \param p number of the probe.
+        /// \return index of the bit probed.
+        uint64_t probeNext(uint64_t *h1, uint64_t *h2, uint8_t p) const
+        {
+            // Enhanced double hashing, the step grows so two files sharing
+            // a position and a step still part ways
+            uint64_t pos = uint64_t(((unsigned __int128)(*h1)*this->bits)>>64);
+            (*h1) += (*h2);
+            (*h2) += p+1;
+            return pos;
+        }
+
+        /// \brief Sets the table geometry.
+        ///
+        /// Validates the geometry, reallocates the table (if needed) and
+        /// clears it. The table is allocated aligned (and padded) to 64 bytes.
+        ///
+        /// \param probes number of bits set for each file.
+        /// \param bits size in bits of the table.
+        /// \param layout how the probes are spread over the table.
+        /// \param index index derivation, INDEX_NIBBLES needs the legacy
+        /// geometry.
+        void configure(uint8_t probes, uint64_t bits,
+            Layout layout=LAYOUT_FLAT, Index index=INDEX_WIDE);
+
+        /// \brief Lists the probes of a hashed file.
+        ///
+        /// \param hash 128b hash of the file.
+        /// \param pos at least maxProbes words, where to store the index of
+        /// each bit probed.
+        /// \return number of positions stored.
+        uint8_t probePositions(const uint32_t *hash, uint64_t *pos) const;
+
         static uint8_t getWord(uint8_t *ptr, uint32_t index);
         static void from3WtoIndex(uint8_t *_3w, uint32_t *dbytes_shift,
             uint16_t *dbbits_shift);
-        static void discoverHighLow(const char *fname, uint8_t *out);
+        static void discoverHighLow(const uint32_t *hash, uint8_t *out);
+
+        /// \brief Check if the bits of a hashed file are set.
+        ///
+        /// \param hash 128b hash of the file.
+        /// \return true if present, false otherwise.
+        bool checkBits(const uint32_t *hash) const;
+
+        /// \brief Returns the side table fingerprint of a hashed file.
+        ///
+        /// \param hash 128b hash of the file.
+        /// \return 32b fingerprint, independent of the probed bits.
+        static uint32_t fingerprint(const uint32_t *hash);
+
+        /// \brief Keeps a fingerprint on the side table.
+        ///
+        /// \param fp the fingerprint.
+        void addFingerprint(uint32_t fp);
+
+        /// \brief Looks for a fingerprint on the side table.
+        ///
+        /// \param fp the fingerprint.
+        /// \return true if present, false otherwise.
+        bool checkFingerprint(uint32_t fp) const;
+
+        /// \brief Sorts the unsorted fingerprints into the sorted ones.
+        void compactFingerprints(void);
+
+        /// \brief Drops the side table, the bits no longer match it.
+        void detachFingerprints(void);
+
+        /// \brief Sets a bit of the table.
+        ///
+        /// \param bit index of the bit to set.
+        void setBit(uint64_t bit)
+        {
+            uint64_t mask = uint64_t(1)<<(bit&63);
+            if (this->concurrent)
+                this->ahashtable[bit>>6].fetch_or(mask, std::memory_order_relaxed);
+            else
+                this->qhashtable[bit>>6] |= mask;
+        }
+
+        /// \brief Tests a bit of the table.
+        ///
+        /// \param bit index of the bit to test.
+        /// \return true if the bit is set.
+        bool testBit(uint64_t bit) const
+        {
+            uint64_t word;
+            if (this->concurrent)
+                word = this->ahashtable[bit>>6].load(std::memory_order_relaxed);
+            else
+                word = this->qhashtable[bit>>6];
+            return (word>>(bit&63))&1;
+        }
+
+        /// \brief Combine a raw table with this one.
+        ///
+        /// \param place Pointer to source of the raw table
+        /// \param len size of source, must be getHTableBytesLen()
+        /// \param op HTKernels::Op to combine with
+        void combineHTable(void *place, size_t len, int op);
+
+        /// \brief Combine many tables with this one.
+        ///
+        /// \param tables array of n tables, with the same geometry
+        /// \param n number of tables
+        /// \param op HTKernels::Op to combine with
+        void combineHTables(const HTFileVersioning * const *tables, size_t n,
+            int op);
+
+        /// \brief Prefetch the table places of a hashed file.
+        ///
+        /// \param hash 128b hash of the file.
+        /// \param write true if the places will be written.
+        void prefetchHash(const uint32_t *hash, bool write) const;
+
+        /// \brief Hash the next window of files and prefetch their places.
+        ///
+        /// \param fnames files left, only the first prefetchWindow are hashed.
+        /// \param n number of files left.
+        /// \param hashes prefetchWindow hashes where to store them.
+        /// \param write true if the places will be written.
+        void hashWindow(const char * const *fnames, size_t n,
+            uint32_t (*hashes)[4], bool write) const;
+
+        /// \brief Builds the mask of a block.
+        ///
+        /// Sets in mask the probes bits of a file inside its block.
+        ///
+        /// \param h2 second half of the file hash.
+        /// \param probes number of probes.
+        /// \param mask 8 words where to build the mask.
+        static void blockMask(uint64_t h2, uint8_t probes, uint64_t *mask);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief Counting hashtable for file versioning.
+///
+/// A table that also allows removing files. Each bit of the table gets a 4b
+/// counter, 4 times the memory of a HTFileVersioning of the same geometry.
+/// The bits are kept as the non zero counters, so checks cost the same.
+/// Counters saturate at 15 and then are never decremented, a file removed
+/// from a saturated position may keep matching.
+////////////////////////////////////////////////////////////////////////////////
+class HTCountingFileVersioning : protected HTFileVersioning {
+    public:
+        using HTFileVersioning::Layout;
+        using HTFileVersioning::HashFamily;
+        using HTFileVersioning::setHashFamily;
+        using HTFileVersioning::getHashFamily;
+        using HTFileVersioning::getHTableBitsLen;
+        using HTFileVersioning::getHTableBytesLen;
+        using HTFileVersioning::getProbes;
+        using HTFileVersioning::getLayout;
+        using HTFileVersioning::Index;
+        using HTFileVersioning::getIndex;
+        using HTFileVersioning::popcount;
+        using HTFileVersioning::fillRatio;
+        using HTFileVersioning::estimatedItems;
+        using HTFileVersioning::estimatedFpr;
+        using HTFileVersioning::checkFile;
+        using HTFileVersioning::checkFiles;
+        using HTFileVersioning::getRawHTable;
+
+        static const uint8_t counterMax = 15; ///< Saturated counter
+
+        /// \brief Default constructor, legacy geometry.
+        HTCountingFileVersioning(void);
+
+        /// \brief Table of bits counters, single probe.
+        ///
+        /// \param bits number of counters of the table.
+        explicit HTCountingFileVersioning(uint64_t bits);
+
+        /// \brief Counting Bloom filter sized for a false positive rate.
+        ///
+        /// Same geometry as HTFileVersioning(expected_items, fpr, layout).
+        ///
+        /// \param expected_items number of files expected on the table.
+        /// \param fpr target false positive rate, in (0, 1).
+        /// \param layout how the probes are spread over the table.
+        HTCountingFileVersioning(uint64_t expected_items, double fpr,
+            Layout layout=LAYOUT_FLAT);
+        ~HTCountingFileVersioning();
+
+        /// \brief Reset the table.
+        ///
+        /// Set all counters to zero.
+        void reset(void);
+
+        /// \brief Add a file.
+        ///
+        /// \param fname null terminated std string.
+        void addFile(const std::string &fname)
+            { this->addFile(fname.c_str()); }
+
+        /// \brief Add a file.
+        ///
+        /// Increment the counters of the file.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        void addFile(const char *fname);
+
+        /// \brief Remove a file.
+        ///
+        /// \param fname null terminated std string.
+        /// \return true if the file was present, false otherwise.
+        bool removeFile(const std::string &fname)
+            { return this->removeFile(fname.c_str()); }
+
+        /// \brief Remove a file.
+        ///
+        /// Decrement the counters of the file, when it is present. Removing a
+        /// file never added may remove other files matching the same bits.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return true if the file was present, false otherwise.
+        bool removeFile(const char *fname);
+
+        /// \brief Returns the compressed counters.
+        ///
+        /// \return std string with counters compressed and encoded.
+        std::string getHTable(void) const;
+
+        /// \brief Returns the compressed bit table.
+        ///
+        /// Exports the non zero counters as a plain table, the one a
+        /// HTFileVersioning of the same geometry imports.
+        ///
+        /// \return std string with table compressed and encoded.
+        std::string getBitHTable(void) const
+            { return HTFileVersioning::getHTable(); }
+
+        /// \brief Set the counters.
+        ///
+        /// Decode and decompress counters exported by getHTable, than set
+        /// them as current table. The geometry is adopted by this table.
+        ///
+        /// \param str Compressed and B64 encoded counters
+        void setHTable(std::string str);
+
+        /// \brief Merge counters
+        ///
+        /// Decode and decompress counters exported by getHTable, than add
+        /// them to current table. Throws if the geometry differs.
+        ///
+        /// \param str Compressed and B64 encoded counters
+        void mergeHTable(std::string str);
+
+        /// \brief Merge table
+        ///
+        /// Add the counters of table to current table, saturating at 15.
+        /// Throws if the geometry differs.
+        ///
+        /// \param table the table to add
+        void mergeHTable(const HTCountingFileVersioning &table);
+
+        /// \brief Subtract table
+        ///
+        /// Subtract the counters of table from current table, removing its
+        /// files. Throws if the geometry differs.
+        ///
+        /// \param table the table to subtract
+        void subtractHTable(const HTCountingFileVersioning &table);
+
+    protected:
+        uint8_t *counters; ///< 4b counters, two per byte, low nibble first
+
+        /// \brief Returns the size in bytes of the counters.
+        size_t getCountersBytesLen(void) const
+            { return divRoundUp(this->bits, blockBitsLen)*(blockBitsLen/2); }
+
+        /// \brief Allocates the counters for the current geometry.
+        void allocCounters(void);
+
+        /// \brief Rebuild the bit table from the counters.
+        void collapse(void);
+
+        /// \brief Checks that table has the geometry of this one.
+        void checkGeometry(const HTCountingFileVersioning &table) const;
 };
 
 #endif
@@ -0,0 +1,281 @@
+#include "ht_fuse_versioning.h"
+#include "ht_file_versioning.h"
+#include "ht_kernels.h"
+
+#include <algorithm>
+
+#include <math.h>
+#include <string.h>
+
+const uint8_t HTFuseFileVersioning::arity;
+const uint32_t HTFuseFileVersioning::maxSegmentLength;
+const unsigned HTFuseFileVersioning::maxAttempts;
+const size_t HTFuseFileVersioning::paramsLen;
+
+/// Seeds of the attempts, splitmix64.
+static inline uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = ((*state) += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint8_t fuseFingerprint(uint64_t hash)
+{
+    return uint8_t(hash ^ (hash >> 32));
+}
+
+HTFuseFileVersioning::HTFuseFileVersioning(void):
+    seed(0), items(0), segmentLength(0), segmentCount(0), frozen(false)
+{
+}
+
+void HTFuseFileVersioning::reset(void)
+{
+    this->keys.clear();
+    this->fingerprints.clear();
+    this->seed = 0;
+    this->items = 0;
+    this->segmentLength = 0;
+    this->segmentCount = 0;
+    this->frozen = false;
+}
+
+uint64_t HTFuseFileVersioning::key(const char *fname)
+{
+    uint32_t hash[4];
+    uint64_t h1, h2;
+
+    HTFileVersioning::hashFile(fname, hash);
+    HTFileVersioning::discoverProbes(hash, &h1, &h2);
+    return h1;
+}
+
+void HTFuseFileVersioning::addFile(const char *fname)
+{
+    if (this->frozen)
+        throw "Frozen table";
+    this->keys.push_back(HTFuseFileVersioning::key(fname));
+}
+
+void HTFuseFileVersioning::configure(uint32_t size)
+{
+    // Sizes of the reference implementation for 3 wise binary fuse filters,
+    // small sets need more room to peel
+    if (size == 0)
+        this->segmentLength = 4;
+    else
+        this->segmentLength =
+            uint32_t(1)<<int(floor(log(double(size))/log(3.33) + 2.25));
+    if (this->segmentLength > maxSegmentLength)
+        this->segmentLength = maxSegmentLength;
+
+    double factor = size <= 1 ? 0 :
+        fmax(1.125, 0.875 + 0.25*log(1000000.0)/log(double(size)));
+    uint64_t capacity = uint64_t(round(double(size)*factor));
+    uint64_t segments = (capacity + this->segmentLength - 1)/this->segmentLength;
+
+    this->segmentCount = segments <= arity-1 ? 1 : segments - (arity-1);
+    this->fingerprints.assign(
+        uint64_t(this->segmentCount + arity - 1)*this->segmentLength, 0);
+}
+
+void HTFuseFileVersioning::positions(uint64_t hash, uint32_t *h) const
+{
+    uint64_t start = uint64_t((unsigned __int128)hash *
+        (uint64_t(this->segmentCount)*this->segmentLength) >> 64);
+    uint32_t mask = this->segmentLength-1;
+
+    h[0] = uint32_t(start);
+    h[1] = (h[0] + this->segmentLength) ^ (uint32_t(hash >> 18) & mask);
+    h[2] = (h[0] + 2*this->segmentLength) ^ (uint32_t(hash) & mask);
+}
+
+void HTFuseFileVersioning::freeze(void)
+{
+    if (this->frozen)
+        return;
+    if (this->keys.size() > UINT32_MAX/2)
+        throw "Too many files";
+
+    // Peeling needs distinct keys
+    std::sort(this->keys.begin(), this->keys.end());
+    this->keys.erase(std::unique(this->keys.begin(), this->keys.end()),
+        this->keys.end());
+
+    uint32_t size = this->keys.size();
+    this->configure(size);
+
+    uint32_t capacity = this->fingerprints.size();
+    std::vector<uint8_t> count(capacity);   // files<<2 | XOR of their slot
+    std::vector<uint64_t> xors(capacity);   // XOR of the files hashes
+    std::vector<uint32_t> alone(capacity);
+    std::vector<uint64_t> stack(size);
+    std::vector<uint8_t> stack_slot(size);
+    uint64_t rng = 0x726b2b9d438b9d4dULL;
+    uint32_t stacked = 0;
+    uint32_t h[5];
+
+    for (unsigned attempt=0; ; ++attempt) {
+        if (attempt == maxAttempts)
+            throw "Could not build the filter";
+
+        this->seed = splitmix64(&rng);
+        std::fill(count.begin(), count.end(), 0);
+        std::fill(xors.begin(), xors.end(), 0);
+
+        bool overflow = false;
+        for (uint32_t k=0; k<size; ++k) {
+            uint64_t hash = HTKernels::fmix64(this->keys[k] + this->seed);
+            this->positions(hash, h);
+            for (uint8_t s=0; s<arity; ++s) {
+                count[h[s]] += 4;
+                count[h[s]] ^= s;
+                xors[h[s]] ^= hash;
+                overflow |= count[h[s]] < 4;
+            }
+        }
+        if (overflow)
+            continue;
+
+        // Peel: a fingerprint with a single file is owned by it, removing
+        // the file may leave its other fingerprints with a single file
+        uint32_t queued = 0;
+        for (uint32_t i=0; i<capacity; ++i)
+            if ((count[i]>>2) == 1)
+                alone[queued++] = i;
+
+        stacked = 0;
+        while (queued) {
+            uint32_t index = alone[--queued];
+            if ((count[index]>>2) != 1)
+                continue;
+
+            uint64_t hash = xors[index];
+            uint8_t found = count[index]&3;
+            this->positions(hash, h);
+            h[3] = h[0];
+            h[4] = h[1];
+
+            stack[stacked] = hash;
+            stack_slot[stacked] = found;
+            ++stacked;
+
+            for (uint8_t o=1; o<arity; ++o) {
+                uint32_t other = h[found+o];
+                if ((count[other]>>2) == 2)
+                    alone[queued++] = other;
+                count[other] -= 4;
+                count[other] ^= (found+o)%3;
+                xors[other] ^= hash;
+            }
+        }
+        if (stacked == size)
+            break;
+    }
+
+    // Assign in reverse peeling order, each file sets the fingerprint it
+    // owns so the XOR of its 3 fingerprints is its own
+    for (uint32_t i=stacked; i>0; --i) {
+        uint64_t hash = stack[i-1];
+        uint8_t found = stack_slot[i-1];
+        this->positions(hash, h);
+        h[3] = h[0];
+        h[4] = h[1];
+
+        this->fingerprints[h[found]] = fuseFingerprint(hash) ^
+            this->fingerprints[h[found+1]] ^ this->fingerprints[h[found+2]];
+    }
+
+    this->items = size;
+    this->frozen = true;
+    std::vector<uint64_t>().swap(this->keys);
+}
+
+bool HTFuseFileVersioning::checkFile(const char *fname) const
+{
+    if (!this->frozen)
+        throw "Table not frozen";
+    if (!this->items)
+        return false;
+
+    uint64_t hash = HTKernels::fmix64(HTFuseFileVersioning::key(fname) +
+        this->seed);
+    uint32_t h[3];
+
+    this->positions(hash, h);
+    return (fuseFingerprint(hash) ^ this->fingerprints[h[0]] ^
+        this->fingerprints[h[1]] ^ this->fingerprints[h[2]]) == 0;
+}
+
+void HTFuseFileVersioning::getRawHTable(void *place, size_t len) const
+{
+    size_t tam = getHTableBytesLen();
+    if (tam > len)
+        tam = len;
+    if (tam)
+        memcpy(place, &this->fingerprints[0], tam);
+}
+
+std::string HTFuseFileVersioning::getHTable(void) const
+{
+    if (!this->frozen)
+        throw "Table not frozen";
+
+    // Parameters ahead of the fingerprints, all little endian
+    std::vector<uint8_t> payload;
+    for (uint8_t b=0; b<64; b+=8)
+        payload.push_back(uint8_t(this->seed>>b));
+    for (uint8_t b=0; b<64; b+=8)
+        payload.push_back(uint8_t(this->items>>b));
+    for (uint8_t b=0; b<32; b+=8)
+        payload.push_back(uint8_t(this->segmentLength>>b));
+    for (uint8_t b=0; b<32; b+=8)
+        payload.push_back(uint8_t(this->segmentCount>>b));
+    payload.insert(payload.end(), this->fingerprints.begin(),
+        this->fingerprints.end());
+
+    return HTFileVersioning::encodeHTable(&payload[0], payload.size(), arity,
+        uint64_t(payload.size())*8, HTFileVersioning::LAYOUT_FLAT,
+        HTFileVersioning::kindFuse);
+}
+
+void HTFuseFileVersioning::setHTable(std::string str)
+{
+    uint8_t probes, kind;
+    uint64_t bits;
+    HTFileVersioning::Layout layout;
+    std::vector<uint8_t> raw;
+
+    HTFileVersioning::decodeHTable(str, raw, &probes, &bits, &layout, &kind);
+    if (kind != HTFileVersioning::kindFuse)
+        throw "Not a fuse table";
+    if (probes != arity || raw.size() < paramsLen)
+        throw "Bad table header";
+
+    uint64_t seed = 0, items = 0;
+    uint32_t segment_length = 0, segment_count = 0;
+    for (uint8_t b=0; b<8; ++b)
+        seed |= uint64_t(raw[b])<<(b*8);
+    for (uint8_t b=0; b<8; ++b)
+        items |= uint64_t(raw[8+b])<<(b*8);
+    for (uint8_t b=0; b<4; ++b)
+        segment_length |= uint32_t(raw[16+b])<<(b*8);
+    for (uint8_t b=0; b<4; ++b)
+        segment_count |= uint32_t(raw[20+b])<<(b*8);
+
+    if (!segment_length || segment_length > maxSegmentLength ||
+        (segment_length & (segment_length-1)) || !segment_count ||
+        raw.size()-paramsLen !=
+            uint64_t(segment_count + arity - 1)*segment_length)
+        throw "Bad table header";
+
+    this->keys.clear();
+    this->fingerprints.assign(raw.begin()+paramsLen, raw.end());
+    this->seed = seed;
+    this->items = items;
+    this->segmentLength = segment_length;
+    this->segmentCount = segment_count;
+    this->frozen = true;
+}
@@ -0,0 +1,150 @@
+#ifndef __HT_FUSE_VERSIONING_H__
+#define __HT_FUSE_VERSIONING_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief Static binary fuse filter for file versioning.
+///
+/// A table for published tables, that are never modified once exported.
+/// Files are added, than freeze builds a binary fuse filter (Graf, Lemire)
+/// from them: 8 bits fingerprints, about 9 bits per file at a false positive
+/// rate of 1/256 (0.4%), and every check reads exactly 3 bytes of the table.
+///
+/// Before freeze only addFile works, after it only checkFile does. Frozen
+/// tables export through getHTable and load with setHTable, already frozen.
+////////////////////////////////////////////////////////////////////////////////
+class HTFuseFileVersioning {
+    public:
+        static const uint8_t arity = 3;  ///< Fingerprints read per check
+        static const uint32_t maxSegmentLength = 1<<18; ///< Max segment size
+        static const unsigned maxAttempts = 100; ///< Seeds tried by freeze
+
+        HTFuseFileVersioning(void);
+
+        /// \brief Returns the size of the table.
+        ///
+        /// \return number of bits of the fingerprints, 0 before freeze.
+        uint64_t getHTableBitsLen(void) const
+        {
+            return uint64_t(this->fingerprints.size())*8;
+        }
+
+        /// \brief Returns the size of the table.
+        ///
+        /// \return number of bytes of the fingerprints, 0 before freeze.
+        uint64_t getHTableBytesLen(void) const
+        {
+            return this->fingerprints.size();
+        }
+
+        /// \brief Returns the number of files on the table.
+        ///
+        /// \return the number of distinct files once frozen, before freeze
+        /// the number of files added, duplicates included.
+        uint64_t getItems(void) const
+        {
+            return this->frozen ? this->items : this->keys.size();
+        }
+
+        /// \brief Returns true once the filter is built.
+        bool isFrozen(void) const
+        {
+            return this->frozen;
+        }
+
+        /// \brief Reset the table.
+        ///
+        /// Drop all files and the filter, the table can take files again.
+        void reset(void);
+
+        /// \brief Add a file.
+        ///
+        /// \param fname null terminated std string.
+        void addFile(const std::string &fname)
+            { this->addFile(fname.c_str()); }
+
+        /// \brief Add a file.
+        ///
+        /// Keep the hash of the file for freeze. Throws once frozen.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        void addFile(const char *fname);
+
+        /// \brief Builds the filter.
+        ///
+        /// Builds the binary fuse filter from the files added, dropping
+        /// them. Throws if no filter could be built (never expected).
+        void freeze(void);
+
+        /// \brief Check a file.
+        ///
+        /// \param fname null terminated std string.
+        /// \return true if present, false otherwise.
+        bool checkFile(const std::string &fname) const
+            { return this->checkFile(fname.c_str()); }
+
+        /// \brief Check a file.
+        ///
+        /// XOR the 3 fingerprints of the file and match its own. Throws
+        /// before freeze.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return true if present, false otherwise.
+        bool checkFile(const char *fname) const;
+
+        /// \brief Copy the raw fingerprints.
+        ///
+        /// \param place pointer to buffer where to copy to.
+        /// \param len size of destination buffer.
+        void getRawHTable(void *place, size_t len) const;
+
+        /// \brief Returns the compressed table.
+        ///
+        /// Throws before freeze.
+        ///
+        /// \return std string with table compressed and encoded.
+        std::string getHTable(void) const;
+
+        /// \brief Set the table.
+        ///
+        /// Decode and decompress a table exported by getHTable, than set it
+        /// as current (frozen) table.
+        ///
+        /// \param str Compressed and B64 encoded table
+        void setHTable(std::string str);
+
+    protected:
+        std::vector<uint64_t> keys;        ///< Hashes of the files to freeze
+        std::vector<uint8_t> fingerprints; ///< The filter
+        uint64_t seed;              ///< Seed of the filter hashes
+        uint64_t items;             ///< Distinct files on the filter
+        uint32_t segmentLength;     ///< Fingerprints per segment
+        uint32_t segmentCount;      ///< Segments a file starts on
+        bool frozen;                ///< Filter built
+
+        static const size_t paramsLen = 24; ///< Exported parameters size
+
+        /// \brief Sizes the filter for a number of files.
+        ///
+        /// \param size number of distinct files.
+        void configure(uint32_t size);
+
+        /// \brief Hash a file.
+        ///
+        /// \param fname null terminated c style string (buffer/array).
+        /// \return the 64b key of the file.
+        static uint64_t key(const char *fname);
+
+        /// \brief Returns the fingerprints of a seeded key hash.
+        ///
+        /// One in each of 3 consecutive segments.
+        ///
+        /// \param hash key hash, mixed with the seed.
+        /// \param h where to store the 3 positions.
+        void positions(uint64_t hash, uint32_t *h) const;
+};
+
+#endif
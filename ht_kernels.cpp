@@ -0,0 +1,1099 @@
+#include "ht_kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+// GCC 12 flags the _mm512_undefined_* placeholders of its own intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#define HT_X86
+#endif
+
+#include "one_at_time.hpp"
+
+#include <string.h>
+
+//  ____  _            _      _____         _   
+// | __ )| | ___   ___| | __ |_   _|__  ___| |_ 
+// |  _ \| |/ _ \ / __| |/ /   | |/ _ \/ __| __|
+// | |_) | | (_) | (__|   <    | |  __/\__ \ |_ 
+// |____/|_|\___/ \___|_|\_\   |_|\___||___/\__|
+//
+typedef bool (*BlockTestFn)(const uint64_t *block, const uint64_t *mask);
+
+static bool blockTestScalar(const uint64_t *block, const uint64_t *mask)
+{
+    uint64_t miss = 0;
+    for (int w=0; w<8; ++w)
+        miss |= mask[w] & ~block[w];
+    return !miss;
+}
+
+#ifdef HT_X86
+__attribute__((target("sse4.1")))
+static bool blockTestSSE41(const uint64_t *block, const uint64_t *mask)
+{
+    const __m128i *b = (const __m128i*)block;
+    const __m128i *m = (const __m128i*)mask;
+
+    __m128i miss = _mm_andnot_si128(_mm_load_si128(b), _mm_loadu_si128(m));
+    miss = _mm_or_si128(miss,
+        _mm_andnot_si128(_mm_load_si128(b+1), _mm_loadu_si128(m+1)));
+    miss = _mm_or_si128(miss,
+        _mm_andnot_si128(_mm_load_si128(b+2), _mm_loadu_si128(m+2)));
+    miss = _mm_or_si128(miss,
+        _mm_andnot_si128(_mm_load_si128(b+3), _mm_loadu_si128(m+3)));
+    return _mm_testz_si128(miss, miss);
+}
+
+__attribute__((target("avx2")))
+static bool blockTestAVX2(const uint64_t *block, const uint64_t *mask)
+{
+    const __m256i *b = (const __m256i*)block;
+    const __m256i *m = (const __m256i*)mask;
+
+    return _mm256_testc_si256(_mm256_load_si256(b), _mm256_loadu_si256(m)) &
+        _mm256_testc_si256(_mm256_load_si256(b+1), _mm256_loadu_si256(m+1));
+}
+#endif
+
+static BlockTestFn getBlockTest(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return blockTestAVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return blockTestSSE41;
+#endif
+    return blockTestScalar;
+}
+
+bool HTKernels::blockTest(const uint64_t *block, const uint64_t *mask)
+{
+    static const BlockTestFn test = getBlockTest();
+    return test(block, mask);
+}
+
+//  _                _       
+// | |    ___   __ _(_) ___  
+// | |   / _ \ / _` | |/ __| 
+// | |__| (_) | (_| | | (__  
+// |_____\___/ \__, |_|\___| 
+//             |___/         
+//
+typedef void (*CombineFn)(uint8_t *dst, const uint8_t * const *srcs, size_t n,
+    size_t len);
+
+template < int Op, typename T >
+static inline T fold(T acc, T v)
+{
+    if (Op == HTKernels::OP_AND)
+        return acc & v;
+    if (Op == HTKernels::OP_XOR)
+        return acc ^ v;
+    return acc | v;
+}
+
+template < int Op, typename T >
+static inline T apply(T dst, T acc)
+{
+    if (Op == HTKernels::OP_OR)
+        return dst | acc;
+    if (Op == HTKernels::OP_AND)
+        return dst & acc;
+    if (Op == HTKernels::OP_XOR)
+        return dst ^ acc;
+    return dst & ~acc;
+}
+
+/// Scalar combine of the [from, len) range, 8 bytes at time.
+template < int Op >
+static void combineScalarRange(uint8_t *dst, const uint8_t * const *srcs,
+    size_t n, size_t from, size_t len)
+{
+    size_t i = from;
+    for (; i+8<=len; i+=8) {
+        uint64_t acc, v, d;
+        memcpy(&acc, srcs[0]+i, 8);
+        for (size_t s=1; s<n; ++s) {
+            memcpy(&v, srcs[s]+i, 8);
+            acc = fold<Op>(acc, v);
+        }
+        memcpy(&d, dst+i, 8);
+        d = apply<Op>(d, acc);
+        memcpy(dst+i, &d, 8);
+    }
+    for (; i<len; ++i) {
+        uint8_t acc = srcs[0][i];
+        for (size_t s=1; s<n; ++s)
+            acc = fold<Op>(acc, srcs[s][i]);
+        dst[i] = apply<Op>(dst[i], acc);
+    }
+}
+
+template < int Op >
+static void combineScalar(uint8_t *dst, const uint8_t * const *srcs, size_t n,
+    size_t len)
+{
+    combineScalarRange<Op>(dst, srcs, n, 0, len);
+}
+
+#ifdef HT_X86
+template < int Op >
+__attribute__((target("avx2")))
+static void combineAVX2(uint8_t *dst, const uint8_t * const *srcs, size_t n,
+    size_t len)
+{
+    size_t i = 0;
+    for (; i+32<=len; i+=32) {
+        __m256i acc = _mm256_loadu_si256((const __m256i*)(srcs[0]+i));
+        for (size_t s=1; s<n; ++s) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(srcs[s]+i));
+            if (Op == HTKernels::OP_AND)
+                acc = _mm256_and_si256(acc, v);
+            else if (Op == HTKernels::OP_XOR)
+                acc = _mm256_xor_si256(acc, v);
+            else
+                acc = _mm256_or_si256(acc, v);
+        }
+
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst+i));
+        if (Op == HTKernels::OP_OR)
+            d = _mm256_or_si256(d, acc);
+        else if (Op == HTKernels::OP_AND)
+            d = _mm256_and_si256(d, acc);
+        else if (Op == HTKernels::OP_XOR)
+            d = _mm256_xor_si256(d, acc);
+        else
+            d = _mm256_andnot_si256(acc, d);
+        _mm256_storeu_si256((__m256i*)(dst+i), d);
+    }
+    combineScalarRange<Op>(dst, srcs, n, i, len);
+}
+
+template < int Op >
+__attribute__((target("avx512f")))
+static void combineAVX512(uint8_t *dst, const uint8_t * const *srcs, size_t n,
+    size_t len)
+{
+    size_t i = 0;
+    for (; i+64<=len; i+=64) {
+        __m512i acc = _mm512_loadu_si512(srcs[0]+i);
+        for (size_t s=1; s<n; ++s) {
+            __m512i v = _mm512_loadu_si512(srcs[s]+i);
+            if (Op == HTKernels::OP_AND)
+                acc = _mm512_and_si512(acc, v);
+            else if (Op == HTKernels::OP_XOR)
+                acc = _mm512_xor_si512(acc, v);
+            else
+                acc = _mm512_or_si512(acc, v);
+        }
+
+        __m512i d = _mm512_loadu_si512(dst+i);
+        if (Op == HTKernels::OP_OR)
+            d = _mm512_or_si512(d, acc);
+        else if (Op == HTKernels::OP_AND)
+            d = _mm512_and_si512(d, acc);
+        else if (Op == HTKernels::OP_XOR)
+            d = _mm512_xor_si512(d, acc);
+        else
+            d = _mm512_andnot_si512(acc, d);
+        _mm512_storeu_si512(dst+i, d);
+    }
+    combineScalarRange<Op>(dst, srcs, n, i, len);
+}
+#endif
+
+template < int Op >
+static CombineFn getCombine(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return combineAVX512<Op>;
+    if (__builtin_cpu_supports("avx2"))
+        return combineAVX2<Op>;
+#endif
+    return combineScalar<Op>;
+}
+
+void HTKernels::combine(uint8_t *dst, const uint8_t * const *srcs, size_t n,
+    size_t len, Op op)
+{
+    static const CombineFn combines[] = {
+        getCombine<OP_OR>(),
+        getCombine<OP_AND>(),
+        getCombine<OP_XOR>(),
+        getCombine<OP_ANDNOT>()
+    };
+
+    if (!n)
+        return;
+    combines[op](dst, srcs, n, len);
+}
+
+//  ____                                    _   
+// |  _ \ ___  _ __   ___ ___  _   _ _ __ | |_ 
+// | |_) / _ \| '_ \ / __/ _ \| | | | '_ \| __|
+// |  __/ (_) | |_) | (_| (_) | |_| | | | | |_ 
+// |_|   \___/| .__/ \___\___/ \__,_|_| |_|\__|
+//            |_|                              
+typedef uint64_t (*PopcountFn)(const uint8_t *buf, size_t len);
+
+/// Counts 8 bytes at time, the compiler emits POPCNT when the target has it.
+static inline uint64_t popcountWords(const uint8_t *buf, size_t len)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i+8<=len; i+=8) {
+        uint64_t w;
+        memcpy(&w, buf+i, 8);
+        count += __builtin_popcountll(w);
+    }
+    for (; i<len; ++i)
+        count += __builtin_popcount(buf[i]);
+    return count;
+}
+
+static uint64_t popcountScalar(const uint8_t *buf, size_t len)
+{
+    return popcountWords(buf, len);
+}
+
+#ifdef HT_X86
+__attribute__((target("popcnt")))
+static uint64_t popcountPOPCNT(const uint8_t *buf, size_t len)
+{
+    return popcountWords(buf, len);
+}
+
+__attribute__((target("popcnt,avx512f,avx512vpopcntdq")))
+static uint64_t popcountAVX512(const uint8_t *buf, size_t len)
+{
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i+64<=len; i+=64)
+        acc = _mm512_add_epi64(acc,
+            _mm512_popcnt_epi64(_mm512_loadu_si512(buf+i)));
+    return _mm512_reduce_add_epi64(acc) + popcountWords(buf+i, len-i);
+}
+#endif
+
+static PopcountFn getPopcount(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq"))
+        return popcountAVX512;
+    if (__builtin_cpu_supports("popcnt"))
+        return popcountPOPCNT;
+#endif
+    return popcountScalar;
+}
+
+uint64_t HTKernels::popcount(const uint8_t *buf, size_t len)
+{
+    static const PopcountFn count = getPopcount();
+    return count(buf, len);
+}
+
+//   ____                  _             
+//  / ___|___  _   _ _ __ | |_ ___ _ __  
+// | |   / _ \| | | | '_ \| __/ _ \ '__| 
+// | |__| (_) | |_| | | | | ||  __/ |    
+//  \____\___/ \__,_|_| |_|\__\___|_|    
+//
+typedef void (*CounterFn)(uint8_t *dst, const uint8_t *src, size_t len);
+typedef void (*CollapseFn)(uint8_t *bits, const uint8_t *counters, size_t len);
+
+static inline uint8_t nibbleAdd(uint8_t a, uint8_t b)
+{
+    uint8_t s = a+b;
+    return s > 15 ? 15 : s;
+}
+
+static inline uint8_t nibbleSub(uint8_t a, uint8_t b)
+{
+    // A saturated counter lost its count, it never goes down again
+    if (a == 15)
+        return 15;
+    return a > b ? a-b : 0;
+}
+
+static void counterAddScalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    for (size_t i=0; i<len; ++i)
+        dst[i] = nibbleAdd(dst[i]&0xF, src[i]&0xF) |
+            nibbleAdd(dst[i]>>4, src[i]>>4)<<4;
+}
+
+static void counterSubScalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    for (size_t i=0; i<len; ++i)
+        dst[i] = nibbleSub(dst[i]&0xF, src[i]&0xF) |
+            nibbleSub(dst[i]>>4, src[i]>>4)<<4;
+}
+
+/// Collapse of the [from, len) range, 4 counters bytes to a bits byte.
+static void countersToBitsRange(uint8_t *bits, const uint8_t *counters,
+    size_t from, size_t len)
+{
+    for (size_t i=from; i<len; i+=4) {
+        uint8_t b = 0;
+        for (size_t j=0; j<4 && i+j<len; ++j) {
+            b |= uint8_t(bool(counters[i+j]&0xF))<<(j*2);
+            b |= uint8_t(bool(counters[i+j]>>4))<<(j*2+1);
+        }
+        bits[i/4] = b;
+    }
+}
+
+static void countersToBitsScalar(uint8_t *bits, const uint8_t *counters,
+    size_t len)
+{
+    countersToBitsRange(bits, counters, 0, len);
+}
+
+#ifdef HT_X86
+__attribute__((target("avx2")))
+static void counterAddAVX2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const __m256i low = _mm256_set1_epi8(0xF);
+    size_t i = 0;
+
+    // Each nibble is added on its own byte, so min() saturates it at 15
+    for (; i+32<=len; i+=32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst+i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i lo = _mm256_min_epu8(_mm256_add_epi8(
+            _mm256_and_si256(d, low), _mm256_and_si256(s, low)), low);
+        __m256i hi = _mm256_min_epu8(_mm256_add_epi8(
+            _mm256_and_si256(_mm256_srli_epi16(d, 4), low),
+            _mm256_and_si256(_mm256_srli_epi16(s, 4), low)), low);
+        _mm256_storeu_si256((__m256i*)(dst+i),
+            _mm256_or_si256(lo, _mm256_slli_epi16(hi, 4)));
+    }
+    counterAddScalar(dst+i, src+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static void counterSubAVX2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    const __m256i low = _mm256_set1_epi8(0xF);
+    size_t i = 0;
+
+    // Saturated counters are ORed back to 15 after the subtraction
+    for (; i+32<=len; i+=32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst+i));
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src+i));
+        __m256i dlo = _mm256_and_si256(d, low);
+        __m256i dhi = _mm256_and_si256(_mm256_srli_epi16(d, 4), low);
+        __m256i lo = _mm256_subs_epu8(dlo, _mm256_and_si256(s, low));
+        __m256i hi = _mm256_subs_epu8(dhi,
+            _mm256_and_si256(_mm256_srli_epi16(s, 4), low));
+        lo = _mm256_or_si256(lo,
+            _mm256_and_si256(_mm256_cmpeq_epi8(dlo, low), low));
+        hi = _mm256_or_si256(hi,
+            _mm256_and_si256(_mm256_cmpeq_epi8(dhi, low), low));
+        _mm256_storeu_si256((__m256i*)(dst+i),
+            _mm256_or_si256(lo, _mm256_slli_epi16(hi, 4)));
+    }
+    counterSubScalar(dst+i, src+i, len-i);
+}
+
+__attribute__((target("sse2")))
+static void countersToBitsSSE2(uint8_t *bits, const uint8_t *counters,
+    size_t len)
+{
+    const __m128i low = _mm_set1_epi8(0xF);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    // Interleaving the low and high nibbles zero tests puts the counters in
+    // table order, movemask then packs them to bits
+    for (; i+16<=len; i+=16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)(counters+i));
+        __m128i lo = _mm_cmpeq_epi8(_mm_and_si128(c, low), zero);
+        __m128i hi = _mm_cmpeq_epi8(
+            _mm_and_si128(_mm_srli_epi16(c, 4), low), zero);
+        uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_unpacklo_epi8(lo, hi))) |
+            uint32_t(_mm_movemask_epi8(_mm_unpackhi_epi8(lo, hi)))<<16;
+        mask = ~mask;
+        memcpy(bits+i/4, &mask, 4);
+    }
+    countersToBitsRange(bits, counters, i, len);
+}
+#endif
+
+static CounterFn getCounterAdd(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return counterAddAVX2;
+#endif
+    return counterAddScalar;
+}
+
+static CounterFn getCounterSub(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return counterSubAVX2;
+#endif
+    return counterSubScalar;
+}
+
+static CollapseFn getCountersToBits(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return countersToBitsSSE2;
+#endif
+    return countersToBitsScalar;
+}
+
+void HTKernels::counterAdd(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    static const CounterFn add = getCounterAdd();
+    add(dst, src, len);
+}
+
+void HTKernels::counterSub(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    static const CounterFn sub = getCounterSub();
+    sub(dst, src, len);
+}
+
+void HTKernels::countersToBits(uint8_t *bits, const uint8_t *counters,
+    size_t len)
+{
+    static const CollapseFn collapse = getCountersToBits();
+    collapse(bits, counters, len);
+}
+
+//   ____            _             _  
+//  / ___|___  _ __ | |_ _ __ ___ | | 
+// | |   / _ \| '_ \| __| '__/ _ \| | 
+// | |__| (_) | | | | |_| | | (_) | | 
+//  \____\___/|_| |_|\__|_|  \___/|_| 
+typedef uint32_t (*GroupMatchFn)(const uint8_t *ctrl, uint8_t tag);
+
+static uint32_t groupMatchScalar(const uint8_t *ctrl, uint8_t tag)
+{
+    uint32_t mask = 0;
+    for (int i=0; i<16; ++i)
+        mask |= uint32_t(ctrl[i] == tag)<<i;
+    return mask;
+}
+
+#ifdef HT_X86
+__attribute__((target("sse2")))
+static uint32_t groupMatchSSE2(const uint8_t *ctrl, uint8_t tag)
+{
+    __m128i group = _mm_load_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
+#endif
+
+static GroupMatchFn getGroupMatch(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return groupMatchSSE2;
+#endif
+    return groupMatchScalar;
+}
+
+uint32_t HTKernels::groupMatch(const uint8_t *ctrl, uint8_t tag)
+{
+    static const GroupMatchFn match = getGroupMatch();
+    return match(ctrl, tag);
+}
+
+//  ____             _           _  
+// / ___|  ___  _ __| |_ ___  __| | 
+// \___ \ / _ \| '__| __/ _ \/ _` | 
+//  ___) | (_) | |  | ||  __/ (_| | 
+// |____/ \___/|_|   \__\___|\__,_| 
+//
+typedef bool (*ScanFn)(const uint32_t *buf, size_t n, uint32_t value);
+
+static bool scanScalar(const uint32_t *buf, size_t n, uint32_t value)
+{
+    bool found = false;
+    for (size_t i=0; i<n; ++i)
+        found |= buf[i] == value;
+    return found;
+}
+
+#ifdef HT_X86
+__attribute__((target("avx2")))
+static bool scanAVX2(const uint32_t *buf, size_t n, uint32_t value)
+{
+    const __m256i v = _mm256_set1_epi32(value);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i+8<=n; i+=8)
+        acc = _mm256_or_si256(acc, _mm256_cmpeq_epi32(v,
+            _mm256_loadu_si256((const __m256i*)(buf+i))));
+    return !_mm256_testz_si256(acc, acc) | scanScalar(buf+i, n-i, value);
+}
+#endif
+
+static ScanFn getScan(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scanAVX2;
+#endif
+    return scanScalar;
+}
+
+bool HTKernels::scanU32(const uint32_t *buf, size_t n, uint32_t value)
+{
+    static const ScanFn scan = getScan();
+    return scan(buf, n, value);
+}
+
+bool HTKernels::searchU32(const uint32_t *sorted, size_t n, uint32_t value)
+{
+    // Keeps value inside [base, base+n), the compiler turns the select
+    // into a conditional move
+    const uint32_t *base = sorted;
+    while (n > 16) {
+        size_t half = n/2;
+        base = (base[half-1] < value) ? base+half : base;
+        n -= half;
+    }
+    return HTKernels::scanU32(base, n, value);
+}
+
+//   ____           
+//  / ___|_ __ ___  
+// | |   | '__/ __| 
+// | |___| | | (__  
+//  \____|_|  \___| 
+//
+typedef uint64_t (*Crc32cFn)(const uint8_t *buf, size_t len);
+typedef uint32_t (*Crc32cSingleFn)(const uint8_t *buf, size_t len,
+    uint32_t crc);
+
+/// CRC32C (Castagnoli) table, reflected polynomial 0x82F63B78.
+struct Crc32cTable {
+    uint32_t entry[256];
+
+    constexpr Crc32cTable(): entry()
+    {
+        for (uint32_t i=0; i<256; ++i) {
+            uint32_t c = i;
+            for (int k=0; k<8; ++k)
+                c = (c>>1) ^ (0x82F63B78 & (0 - (c&1)));
+            this->entry[i] = c;
+        }
+    }
+};
+
+// Built at compile time, so threads never race to fill it
+static constexpr Crc32cTable crc32cBytes;
+
+static const uint32_t *crc32cTable(void)
+{
+    return crc32cBytes.entry;
+}
+
+static inline uint32_t crc32cByte(const uint32_t *table, uint32_t crc,
+    uint8_t byte)
+{
+    return (crc>>8) ^ table[(crc^byte)&0xFF];
+}
+
+static inline uint32_t crc32cWord(const uint32_t *table, uint32_t crc,
+    uint64_t word)
+{
+    for (int b=0; b<8; ++b)
+        crc = crc32cByte(table, crc, uint8_t(word>>(b*8)));
+    return crc;
+}
+
+// Two streams, the second one over the words rotated by 32 bits: two
+// different linear maps of the data, 64 bits between them. The second one
+// also takes the tail as a zero padded word, rotated, and starts from its
+// own seed with the length in it: with the same tail bytes, short buffers
+// would get c2 == c1 ^ f(len)
+static inline uint32_t crc32cPairSeed(size_t len)
+{
+    return 0x9E3779B9 ^ uint32_t(len);
+}
+
+static inline uint64_t crc32cTail(const uint8_t *buf, size_t len)
+{
+    uint64_t w = 0;
+    memcpy(&w, buf, len);
+    return (w>>32) | (w<<32);
+}
+
+static uint64_t crc32cScalar(const uint8_t *buf, size_t len)
+{
+    const uint32_t *table = crc32cTable();
+    uint32_t c1 = 0xFFFFFFFF, c2 = crc32cPairSeed(len);
+    size_t i = 0;
+
+    for (; i+8<=len; i+=8) {
+        uint64_t w;
+        memcpy(&w, buf+i, 8);
+        c1 = crc32cWord(table, c1, w);
+        c2 = crc32cWord(table, c2, (w>>32) | (w<<32));
+    }
+    if (i < len)
+        c2 = crc32cWord(table, c2, crc32cTail(buf+i, len-i));
+    for (; i<len; ++i)
+        c1 = crc32cByte(table, c1, buf[i]);
+    return uint64_t(c2)<<32 | c1;
+}
+
+static uint32_t crc32cSingleScalar(const uint8_t *buf, size_t len,
+    uint32_t crc)
+{
+    const uint32_t *table = crc32cTable();
+    uint32_t c = ~crc;
+    size_t i = 0;
+
+    for (; i+8<=len; i+=8) {
+        uint64_t w;
+        memcpy(&w, buf+i, 8);
+        c = crc32cWord(table, c, w);
+    }
+    for (; i<len; ++i)
+        c = crc32cByte(table, c, buf[i]);
+    return ~c;
+}
+
+#ifdef HT_X86
+__attribute__((target("sse4.2")))
+static uint64_t crc32cSSE42(const uint8_t *buf, size_t len)
+{
+    uint64_t c1 = 0xFFFFFFFF, c2 = crc32cPairSeed(len);
+    size_t i = 0;
+
+    for (; i+8<=len; i+=8) {
+        uint64_t w;
+        memcpy(&w, buf+i, 8);
+        c1 = _mm_crc32_u64(c1, w);
+        c2 = _mm_crc32_u64(c2, (w>>32) | (w<<32));
+    }
+    if (i < len)
+        c2 = _mm_crc32_u64(c2, crc32cTail(buf+i, len-i));
+    for (; i<len; ++i)
+        c1 = _mm_crc32_u8(uint32_t(c1), buf[i]);
+    return c2<<32 | c1;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSingleSSE42(const uint8_t *buf, size_t len,
+    uint32_t crc)
+{
+    uint64_t c = uint32_t(~crc);
+    size_t i = 0;
+
+    for (; i+8<=len; i+=8) {
+        uint64_t w;
+        memcpy(&w, buf+i, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    for (; i<len; ++i)
+        c = _mm_crc32_u8(uint32_t(c), buf[i]);
+    return ~uint32_t(c);
+}
+#endif
+
+static Crc32cFn getCrc32c(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32cSSE42;
+#endif
+    return crc32cScalar;
+}
+
+uint64_t HTKernels::crc32cPair(const uint8_t *buf, size_t len)
+{
+    static const Crc32cFn crc = getCrc32c();
+    return crc(buf, len);
+}
+
+static Crc32cSingleFn getCrc32cSingle(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return crc32cSingleSSE42;
+#endif
+    return crc32cSingleScalar;
+}
+
+uint32_t HTKernels::crc32c(const uint8_t *buf, size_t len, uint32_t crc)
+{
+    static const Crc32cSingleFn fn = getCrc32cSingle();
+    return fn(buf, len, crc);
+}
+
+//  ____  _ _    
+// | __ )(_) |_  
+// |  _ \| | __| 
+// | |_) | | |_  
+// |____/|_|\__| 
+//
+// Plain shifts on every CPU: fixed width codes need no BMI2 deposit or
+// extract, and those are microcoded on some CPUs
+
+/// Appends whole codes to a 64 bits accumulator, storing 32 bits at time.
+void HTKernels::packBits(const uint32_t *codes, size_t n, uint8_t width,
+    uint8_t *out)
+{
+    uint64_t acc = 0;
+    unsigned filled = 0;
+
+    for (size_t i=0; i<n; ++i) {
+        acc |= uint64_t(codes[i]) << filled;
+        filled += width;
+        if (filled >= 32) {
+            uint32_t word = uint32_t(acc);
+            memcpy(out, &word, 4);
+            out += 4;
+            acc >>= 32;
+            filled -= 32;
+        }
+    }
+    for (; filled > 0; filled -= (filled < 8) ? filled : 8) {
+        *out++ = uint8_t(acc);
+        acc >>= 8;
+    }
+}
+
+/// Reads each code with a single 8 bytes load at its first byte, a code of
+/// up to 32 bits never spans more than 5 bytes. The last codes are loaded
+/// byte by byte, to stay inside in.
+void HTKernels::unpackBits(const uint8_t *in, size_t n, uint8_t width,
+    uint32_t *codes)
+{
+    size_t len = (uint64_t(n)*width + 7)/8;
+    uint64_t mask = (uint64_t(1)<<width) - 1;
+    uint64_t pos = 0;
+    size_t i = 0;
+
+    for (; i<n && pos/8+8 <= len; ++i, pos+=width) {
+        uint64_t w;
+        memcpy(&w, in+pos/8, 8);
+        codes[i] = uint32_t((w >> (pos&7)) & mask);
+    }
+    for (; i<n; ++i, pos+=width) {
+        uint64_t w = 0;
+        for (size_t b=pos/8; b<len && b<pos/8+8; ++b)
+            w |= uint64_t(in[b]) << ((b-pos/8)*8);
+        codes[i] = uint32_t((w >> (pos&7)) & mask);
+    }
+}
+
+//  _   _           _     _             
+// | | | | __ _ ___| |__ (_)_ __   __ _ 
+// | |_| |/ _` / __| '_ \| | '_ \ / _` |
+// |  _  | (_| \__ \ | | | | | | | (_| |
+// |_| |_|\__,_|___/_| |_|_|_| |_|\__, |
+//                                |___/ 
+typedef size_t (*OneAtTimeMixFn)(const unsigned char *buf, size_t len,
+    uint32_t *ihash, uint8_t buckets);
+typedef void (*OneAtTimeHashFn)(const Buffer *buffers, Hash *rets,
+    uint8_t buckets);
+
+#ifdef HT_X86
+/// Mixes the whole steps of buf, 4 buckets per SSE register.
+///
+/// \return number of bytes mixed.
+__attribute__((target("sse2")))
+static size_t oneAtTimeMixSSE2(const unsigned char *buf, size_t len,
+    uint32_t *ihash, uint8_t buckets)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t steps = len/buckets;
+
+    for (uint8_t g=0; g<buckets; g+=4) {
+        __m128i h = _mm_loadu_si128((const __m128i*)(ihash+g));
+        const unsigned char *p = buf+g;
+
+        for (size_t s=0; s<steps; ++s, p+=buckets) {
+            uint32_t w;
+            memcpy(&w, p, 4);
+            __m128i b = _mm_unpacklo_epi16(
+                _mm_unpacklo_epi8(_mm_cvtsi32_si128(w), zero), zero);
+            h = _mm_add_epi32(h, b);
+            h = _mm_add_epi32(h, _mm_slli_epi32(h, 10));
+            h = _mm_xor_si128(h, _mm_srli_epi32(h, 6));
+        }
+        _mm_storeu_si128((__m128i*)(ihash+g), h);
+    }
+    return steps*buckets;
+}
+
+/// Mixes the whole steps of buf, 8 buckets per AVX2 register.
+///
+/// \return number of bytes mixed.
+__attribute__((target("avx2")))
+static size_t oneAtTimeMixAVX2(const unsigned char *buf, size_t len,
+    uint32_t *ihash, uint8_t buckets)
+{
+    size_t steps = len/buckets;
+
+    for (uint8_t g=0; g<buckets; g+=8) {
+        __m256i h = _mm256_loadu_si256((const __m256i*)(ihash+g));
+        const unsigned char *p = buf+g;
+
+        for (size_t s=0; s<steps; ++s, p+=buckets) {
+            __m256i b = _mm256_cvtepu8_epi32(
+                _mm_loadl_epi64((const __m128i*)p));
+            h = _mm256_add_epi32(h, b);
+            h = _mm256_add_epi32(h, _mm256_slli_epi32(h, 10));
+            h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 6));
+        }
+        _mm256_storeu_si256((__m256i*)(ihash+g), h);
+    }
+    return steps*buckets;
+}
+
+/// One at time step on 8 lanes.
+__attribute__((target("avx2")))
+static inline __m256i mix8(__m256i h, __m256i b)
+{
+    h = _mm256_add_epi32(h, b);
+    h = _mm256_add_epi32(h, _mm256_slli_epi32(h, 10));
+    return _mm256_xor_si256(h, _mm256_srli_epi32(h, 6));
+}
+
+/// Hashes 8 buffers, buffer k on lane k of a register per bucket.
+__attribute__((target("avx2")))
+static void oneAtTimeHashAVX2(const Buffer *buffers, Hash *rets,
+    uint8_t buckets)
+{
+    const unsigned char *p[8];
+    uint32_t lens[8];
+    size_t min_len = buffers[0].len, max_len = 0;
+    __m256i h[255];
+    uint32_t lane[8];
+
+    for (int k=0; k<8; ++k) {
+        p[k] = buffers[k].cbuffer;
+        lens[k] = buffers[k].len;
+        if (buffers[k].len < min_len) min_len = buffers[k].len;
+        if (buffers[k].len > max_len) max_len = buffers[k].len;
+    }
+    for (uint8_t b=0; b<buckets; ++b) {
+        for (int k=0; k<8; ++k)
+            lane[k] = rets[k].ihash[b];
+        h[b] = _mm256_loadu_si256((const __m256i*)lane);
+    }
+
+    // Whole steps of the shortest buffer need no mask, with 4n
+    // buckets the bytes are loaded 4 at time and split in lanes
+    const __m256i low = _mm256_set1_epi32(0xFF);
+    size_t i = 0;
+    size_t full = min_len/buckets*buckets;
+    if (buckets%4 == 0) {
+        for (; i<full; i+=buckets)
+            for (uint8_t b=0; b<buckets; b+=4) {
+                for (int k=0; k<8; ++k)
+                    memcpy(&lane[k], p[k]+i+b, 4);
+                __m256i w = _mm256_loadu_si256((const __m256i*)lane);
+                h[b] = mix8(h[b], _mm256_and_si256(w, low));
+                h[b+1] = mix8(h[b+1],
+                    _mm256_and_si256(_mm256_srli_epi32(w, 8), low));
+                h[b+2] = mix8(h[b+2],
+                    _mm256_and_si256(_mm256_srli_epi32(w, 16), low));
+                h[b+3] = mix8(h[b+3], _mm256_srli_epi32(w, 24));
+            }
+    } else {
+        for (; i<full; i+=buckets)
+            for (uint8_t b=0; b<buckets; ++b) {
+                for (int k=0; k<8; ++k)
+                    lane[k] = p[k][i+b];
+                h[b] = mix8(h[b],
+                    _mm256_loadu_si256((const __m256i*)lane));
+            }
+    }
+
+    // The rest, lanes past the end of their buffer keep their hash
+    __m256i lenv = _mm256_loadu_si256((const __m256i*)lens);
+    for (; i<max_len; i+=buckets)
+        for (uint8_t b=0; b<buckets && i+b<max_len; ++b) {
+            uint32_t at = i+b;
+            for (int k=0; k<8; ++k)
+                lane[k] = at < lens[k] ? p[k][at] : 0;
+            __m256i active = _mm256_cmpgt_epi32(lenv,
+                _mm256_set1_epi32(at));
+            h[b] = _mm256_blendv_epi8(h[b],
+                mix8(h[b], _mm256_loadu_si256((const __m256i*)lane)),
+                active);
+        }
+
+    for (uint8_t b=0; b<buckets; ++b) {
+        __m256i x = h[b];
+        x = _mm256_add_epi32(x, _mm256_slli_epi32(x, 3));
+        x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 11));
+        x = _mm256_add_epi32(x, _mm256_slli_epi32(x, 15));
+        _mm256_storeu_si256((__m256i*)lane, x);
+        for (int k=0; k<8; ++k)
+            rets[k].ihash[b] = lane[k];
+    }
+}
+
+/// One at time step on 16 lanes, lanes out of active are kept.
+__attribute__((target("avx512f")))
+static inline __m512i mix16(__m512i h, __m512i b, __mmask16 active)
+{
+    __m512i x = _mm512_add_epi32(h, b);
+    x = _mm512_add_epi32(x, _mm512_slli_epi32(x, 10));
+    x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 6));
+    return _mm512_mask_mov_epi32(h, active, x);
+}
+
+/// Hashes 16 buffers, buffer k on lane k of a register per bucket.
+__attribute__((target("avx512f")))
+static void oneAtTimeHashAVX512(const Buffer *buffers, Hash *rets,
+    uint8_t buckets)
+{
+    const unsigned char *p[16];
+    uint32_t lens[16];
+    size_t min_len = buffers[0].len, max_len = 0;
+    __m512i h[255];
+    uint32_t lane[16];
+
+    for (int k=0; k<16; ++k) {
+        p[k] = buffers[k].cbuffer;
+        lens[k] = buffers[k].len;
+        if (buffers[k].len < min_len) min_len = buffers[k].len;
+        if (buffers[k].len > max_len) max_len = buffers[k].len;
+    }
+    for (uint8_t b=0; b<buckets; ++b) {
+        for (int k=0; k<16; ++k)
+            lane[k] = rets[k].ihash[b];
+        h[b] = _mm512_loadu_si512(lane);
+    }
+
+    const __m512i low = _mm512_set1_epi32(0xFF);
+    const __mmask16 all = 0xFFFF;
+    size_t i = 0;
+    size_t full = min_len/buckets*buckets;
+    if (buckets%4 == 0) {
+        for (; i<full; i+=buckets)
+            for (uint8_t b=0; b<buckets; b+=4) {
+                for (int k=0; k<16; ++k)
+                    memcpy(&lane[k], p[k]+i+b, 4);
+                __m512i w = _mm512_loadu_si512(lane);
+                h[b] = mix16(h[b], _mm512_and_si512(w, low), all);
+                h[b+1] = mix16(h[b+1],
+                    _mm512_and_si512(_mm512_srli_epi32(w, 8), low), all);
+                h[b+2] = mix16(h[b+2],
+                    _mm512_and_si512(_mm512_srli_epi32(w, 16), low), all);
+                h[b+3] = mix16(h[b+3], _mm512_srli_epi32(w, 24), all);
+            }
+    } else {
+        for (; i<full; i+=buckets)
+            for (uint8_t b=0; b<buckets; ++b) {
+                for (int k=0; k<16; ++k)
+                    lane[k] = p[k][i+b];
+                h[b] = mix16(h[b], _mm512_loadu_si512(lane), all);
+            }
+    }
+
+    __m512i lenv = _mm512_loadu_si512(lens);
+    for (; i<max_len; i+=buckets)
+        for (uint8_t b=0; b<buckets && i+b<max_len; ++b) {
+            uint32_t at = i+b;
+            for (int k=0; k<16; ++k)
+                lane[k] = at < lens[k] ? p[k][at] : 0;
+            h[b] = mix16(h[b], _mm512_loadu_si512(lane),
+                _mm512_cmpgt_epu32_mask(lenv, _mm512_set1_epi32(at)));
+        }
+
+    for (uint8_t b=0; b<buckets; ++b) {
+        __m512i x = h[b];
+        x = _mm512_add_epi32(x, _mm512_slli_epi32(x, 3));
+        x = _mm512_xor_si512(x, _mm512_srli_epi32(x, 11));
+        x = _mm512_add_epi32(x, _mm512_slli_epi32(x, 15));
+        _mm512_storeu_si512(lane, x);
+        for (int k=0; k<16; ++k)
+            rets[k].ihash[b] = lane[k];
+    }
+}
+#endif
+
+#ifdef HT_X86
+static OneAtTimeMixFn getOneAtTimeMix8(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return oneAtTimeMixAVX2;
+    return oneAtTimeMixSSE2;
+}
+#endif
+
+static OneAtTimeHashFn getOneAtTimeHash8(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return oneAtTimeHashAVX2;
+#endif
+    return NULL;
+}
+
+static OneAtTimeHashFn getOneAtTimeHash16(void)
+{
+#ifdef HT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return oneAtTimeHashAVX512;
+#endif
+    return NULL;
+}
+
+size_t HTKernels::oneAtTimeMix(const unsigned char *buf, size_t len,
+    uint32_t *ihash, uint8_t buckets)
+{
+#ifdef HT_X86
+    static const OneAtTimeMixFn mix8 = getOneAtTimeMix8();
+    if (buckets%8 == 0)
+        return mix8(buf, len, ihash, buckets);
+    if (buckets%4 == 0)
+        return oneAtTimeMixSSE2(buf, len, ihash, buckets);
+#endif
+    return 0;
+}
+
+size_t HTKernels::oneAtTimeHash(const Buffer *buffers, Hash *rets, size_t n,
+    uint8_t buckets)
+{
+    static const OneAtTimeHashFn hash16 = getOneAtTimeHash16();
+    static const OneAtTimeHashFn hash8 = getOneAtTimeHash8();
+    size_t k = 0;
+
+    // Lanes compare lengths as 32b
+    for (size_t i=0; i<n; ++i)
+        if (buffers[i].len >= (size_t(1)<<31))
+            return 0;
+
+    if (hash16)
+        for (; k+16<=n; k+=16)
+            hash16(buffers+k, rets+k, buckets);
+    if (hash8)
+        for (; k+8<=n; k+=8)
+            hash8(buffers+k, rets+k, buckets);
+    return k;
+}
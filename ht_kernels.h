@@ -0,0 +1,210 @@
+#ifndef __HT_KERNELS_H__
+#define __HT_KERNELS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct Buffer;
+struct Hash;
+
+////////////////////////////////////////////////////////////////////////////////
+/// \brief Table kernels.
+///
+/// The hot loops over raw tables. Most kernels pick, on their first call, the
+/// best implementation for the running CPU (AVX-512, AVX2, SSE or scalar).
+////////////////////////////////////////////////////////////////////////////////
+class HTKernels {
+    public:
+        /// \brief Combine operations.
+        enum Op {
+            OP_OR = 0,     ///< dst |= src
+            OP_AND = 1,    ///< dst &= src
+            OP_XOR = 2,    ///< dst ^= src
+            OP_ANDNOT = 3  ///< dst &= ~src
+        };
+
+        /// \brief Tests a block.
+        ///
+        /// \param block 64 bytes aligned block of the table.
+        /// \param mask 64 bytes mask.
+        /// \return true when all bits of mask are set in block.
+        static bool blockTest(const uint64_t *block, const uint64_t *mask);
+
+        /// \brief Combine tables.
+        ///
+        /// Combine n source tables into dst in a single pass. For OP_OR,
+        /// OP_AND and OP_XOR the sources are folded with the same operation,
+        /// for OP_ANDNOT every bit set in any source is cleared.
+        ///
+        /// \param dst destination table.
+        /// \param srcs array of n source tables.
+        /// \param n number of source tables.
+        /// \param len size in bytes of all tables.
+        /// \param op operation to combine with.
+        static void combine(uint8_t *dst, const uint8_t * const *srcs, size_t n,
+            size_t len, Op op);
+
+        /// \brief Count bits.
+        ///
+        /// \param buf buffer to count.
+        /// \param len size in bytes of buf.
+        /// \return number of bits set in buf.
+        static uint64_t popcount(const uint8_t *buf, size_t len);
+
+        /// \brief Add counters.
+        ///
+        /// Add, nibble by nibble, the 4b counters of src to dst, saturating
+        /// at 15.
+        ///
+        /// \param dst destination counters.
+        /// \param src source counters.
+        /// \param len size in bytes of both.
+        static void counterAdd(uint8_t *dst, const uint8_t *src, size_t len);
+
+        /// \brief Subtract counters.
+        ///
+        /// Subtract, nibble by nibble, the 4b counters of src from dst,
+        /// stopping at 0. Saturated (15) counters of dst are kept.
+        ///
+        /// \param dst destination counters.
+        /// \param src source counters.
+        /// \param len size in bytes of both.
+        static void counterSub(uint8_t *dst, const uint8_t *src, size_t len);
+
+        /// \brief Collapse counters to bits.
+        ///
+        /// Set each bit of bits when its 4b counter is not zero.
+        ///
+        /// \param bits destination, len/4 bytes (rounded up).
+        /// \param counters source counters.
+        /// \param len size in bytes of counters.
+        static void countersToBits(uint8_t *bits, const uint8_t *counters,
+            size_t len);
+
+        /// \brief Matches a group of control bytes.
+        ///
+        /// \param ctrl 16 bytes aligned group of control bytes.
+        /// \param tag the byte to look for.
+        /// \return mask with bit i set when ctrl[i] == tag.
+        static uint32_t groupMatch(const uint8_t *ctrl, uint8_t tag);
+
+        /// \brief Looks for a value.
+        ///
+        /// \param buf values to scan, in any order.
+        /// \param n number of values.
+        /// \param value the value to look for.
+        /// \return true when buf holds value.
+        static bool scanU32(const uint32_t *buf, size_t n, uint32_t value);
+
+        /// \brief Looks for a value in a sorted array.
+        ///
+        /// Narrows the array with a branch free binary search, than scans
+        /// the last few values with scanU32.
+        ///
+        /// \param sorted values to search, sorted ascending.
+        /// \param n number of values.
+        /// \param value the value to look for.
+        /// \return true when sorted holds value.
+        static bool searchU32(const uint32_t *sorted, size_t n, uint32_t value);
+
+        /// \brief Two CRC32C of a buffer.
+        ///
+        /// The CRC32C (no final inversion) of buf, and the CRC32C of buf
+        /// with the halves of each 8 bytes word swapped, the last partial
+        /// word zero padded, from a seed holding len. Runs on SSE4.2 when
+        /// the CPU has it.
+        ///
+        /// Both are linear in buf, so the pair is 64 bits of state: any two
+        /// buffers share both CRCs with chance 2^-64 at best. Buffers of the
+        /// same length that only differ inside 4 consecutive bytes never
+        /// share the first one.
+        ///
+        /// \param buf buffer to hash.
+        /// \param len size in bytes of buf.
+        /// \return the second CRC in the high 32 bits, the first in the low.
+        static uint64_t crc32cPair(const uint8_t *buf, size_t len);
+
+        /// \brief CRC32C of a buffer.
+        ///
+        /// The standard CRC32C (Castagnoli) of buf. Runs on SSE4.2 when the
+        /// CPU has it.
+        ///
+        /// \param buf buffer to check.
+        /// \param len size in bytes of buf.
+        /// \param crc CRC32C of the previous data, to continue a checksum.
+        /// \return the CRC32C of the previous data followed by buf.
+        static uint32_t crc32c(const uint8_t *buf, size_t len, uint32_t crc=0);
+
+        /// \brief Packs codes.
+        ///
+        /// Writes n codes of width bits each, least significant bits first,
+        /// with no gaps between them.
+        ///
+        /// \param codes codes to pack, each below 2^width.
+        /// \param n number of codes.
+        /// \param width bits per code, 1 to 32.
+        /// \param out where to write, (n*width+7)/8 bytes.
+        static void packBits(const uint32_t *codes, size_t n, uint8_t width,
+            uint8_t *out);
+
+        /// \brief Unpacks codes.
+        ///
+        /// Reads n codes written by packBits.
+        ///
+        /// \param in packed codes, (n*width+7)/8 bytes.
+        /// \param n number of codes.
+        /// \param width bits per code, 1 to 32.
+        /// \param codes where to store the codes.
+        static void unpackBits(const uint8_t *in, size_t n, uint8_t width,
+            uint32_t *codes);
+
+        /// \brief Mixes whole steps of a Bucket One at time hash.
+        ///
+        /// Byte i of buf goes to bucket i%buckets, so each step of buckets
+        /// bytes updates every bucket once: one SIMD lane per bucket. Runs
+        /// on AVX2 with a multiple of 8 buckets, on SSE2 with a multiple of
+        /// 4.
+        ///
+        /// \param buf bytes to mix, the first one going to bucket 0.
+        /// \param len size in bytes of buf.
+        /// \param ihash the buckets, not finished.
+        /// \param buckets number of buckets.
+        /// \return number of bytes mixed, whole steps only, 0 when no SIMD
+        /// implementation fits.
+        static size_t oneAtTimeMix(const unsigned char *buf, size_t len,
+            uint32_t *ihash, uint8_t buckets);
+
+        /// \brief Bucket One at time hashes of many buffers.
+        ///
+        /// Hashes the first buffers 16 (AVX-512) or 8 (AVX2) at once, one
+        /// per SIMD lane, masking the lanes of the buffers already done.
+        ///
+        /// \param buffers array of n buffers to be hashed, each under 2GiB.
+        /// \param rets array of n hashes of buckets buckets, where to copy
+        /// the finished hashes to.
+        /// \param n number of buffers.
+        /// \param buckets number of buckets of every hash.
+        /// \return number of leading buffers hashed, the caller hashes the
+        /// rest.
+        static size_t oneAtTimeHash(const Buffer *buffers, Hash *rets,
+            size_t n, uint8_t buckets);
+
+        /// \brief Mixes a word.
+        ///
+        /// Murmur3 64b finalizer, every input bit flips about half of the
+        /// output bits.
+        ///
+        /// \param k word to mix.
+        /// \return the mixed word.
+        static inline uint64_t fmix64(uint64_t k)
+        {
+            k ^= k >> 33;
+            k *= 0xff51afd7ed558ccdULL;
+            k ^= k >> 33;
+            k *= 0xc4ceb9fe1a85ec53ULL;
+            k ^= k >> 33;
+            return k;
+        }
+};
+
+#endif
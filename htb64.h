@@ -15,7 +15,7 @@ class HT_B64 {
         ~HT_B64()
         {
             if (this->decoding_table)
-                delete this->decoding_table;
+                delete[] this->decoding_table;
         }
 
         /// \brief Encodes using B64.
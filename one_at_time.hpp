@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "ht_kernels.h"
+
 /// \brief Buffer class.
 ///
 /// Helps managing the buffers
@@ -41,8 +43,11 @@ struct Buffer {
 /// \brief Holds hashes.
 ///
 /// This class holds hashes of arbitrary sizes, helps manage them and prevent
-/// memory leaks.
+/// memory leaks. Hashes up to inlineBuckets buckets live inside the object,
+/// so they cost no allocation, bigger ones are allocated.
 struct Hash {
+    static const uint8_t inlineBuckets = 8; ///< Buckets kept inline
+
     /// \Brief Pointer to hash.
     ///
     /// This union is a helper to prevent the nessecity of casts, as all pointers
@@ -63,36 +68,224 @@ struct Hash {
     { }
     /// Create empty hash with buckets size.
     Hash(uint8_t buckets):
-        hash(new unsigned char[buckets*4]()), hash_size(buckets*4)
+        hash(NULL), hash_size(0)
     {
+        this->resize(buckets*4);
         bzero(this->hash, this->hash_size);
     }
-    Hash(const Hash &other)
+    Hash(const Hash &other):
+        hash(NULL), hash_size(0)
     {
         this->operator=(other);
     }
+    /// Takes the storage of other, leaving it as a NULL hash.
+    Hash(Hash &&other) noexcept:
+        hash(NULL), hash_size(0)
+    {
+        this->operator=(static_cast<Hash&&>(other));
+    }
     ~Hash() 
     {
         this->clean();
     }
     Hash& operator=(const Hash &other) 
     {
-        this->clean();
-        this->hash_size = other.hash_size;
-        this->chash = new unsigned char[other.hash_size]();
-        memcpy(this->hash, other.hash, other.hash_size);
+        if (this == &other)
+            return *this;
+        this->resize(other.hash_size);
+        if (other.hash_size)
+            memcpy(this->hash, other.hash, other.hash_size);
         return *this;
     }
+    Hash& operator=(Hash &&other) noexcept
+    {
+        if (this == &other)
+            return *this;
+        if (!other.hash || other.isInline()) {
+            this->operator=(static_cast<const Hash&>(other));
+        } else {
+            this->clean();
+            this->hash = other.hash;
+            this->hash_size = other.hash_size;
+            other.hash = NULL;
+            other.hash_size = 0;
+        }
+        other.clean();
+        return *this;
+    }
+    /// Returns true if the hash lives inside the object.
+    bool isInline(void) const
+    {
+        return this->ihash == this->storage;
+    }
     /// Cleans state.
     ///
     /// Delete this hash (if needed) and set it as a NULL hash.
     void clean(void)
     {
-        if (this->chash)
-            delete this->chash;
+        if (this->chash && !this->isInline())
+            delete[] this->chash;
         this->hash = NULL;
         this->hash_size = 0;
     }
+
+    private:
+        uint32_t storage[inlineBuckets]; ///< Inline hash
+
+        /// Sets the hash size, keeping the storage when it fits.
+        void resize(size_t size)
+        {
+            if (this->hash && size == this->hash_size)
+                return;
+            this->clean();
+            if (!size)
+                return;
+            if (size <= sizeof(this->storage))
+                this->ihash = this->storage;
+            else
+                this->chash = new unsigned char[size];
+            this->hash_size = size;
+        }
+};
+
+/// \brief Holds a hash in progress.
+///
+/// The buckets not yet finished and the number of bytes mixed so far. States
+/// copy like hashes, so the state of a common prefix can be kept and resumed
+/// for each buffer that starts with it.
+struct HashState {
+    Hash hash;  ///< Buckets not yet finished
+    size_t len; ///< Bytes mixed
+
+    /// NULL constructor.
+    HashState(void):
+        len(0)
+    { }
+    /// Create the state of an empty buffer with buckets size.
+    HashState(uint8_t buckets):
+        hash(buckets), len(0)
+    { }
+};
+
+/// \brief Bucket One at time hashes with a fixed number of buckets.
+///
+/// Same hashes of BuckedOneAtTimeHash for hashes of N buckets. The number of
+/// buckets is known at compile time, so each step of N bytes is unrolled
+/// and no byte pays a modulo. Everything is constexpr: string literals and
+/// fixed prefixes can be hashed at compile time.
+template <uint8_t N>
+class FixedBuckedOneAtTimeHash {
+    static_assert(N > 0, "at least one bucket");
+
+    public:
+        /// \brief A finished hash.
+        struct Value {
+            uint32_t ihash[N]; ///< Buckets
+
+            constexpr uint32_t operator[](size_t i) const
+            {
+                return this->ihash[i];
+            }
+        };
+
+        /// \brief A hash in progress.
+        ///
+        /// Buckets not yet finished and the bytes mixed so far, that tell
+        /// the bucket of the next byte.
+        struct State {
+            uint32_t ihash[N]; ///< Buckets
+            size_t len;        ///< Bytes mixed
+        };
+
+        /// Returns the state of an empty buffer.
+        static constexpr State init(void)
+        {
+            return State{};
+        }
+
+        /// Mixes buf into state.
+        ///
+        /// \param state the hash in progress.
+        /// \param buf the bytes to be mixed (char or unsigned char).
+        /// \param len number of bytes of buf.
+        ///
+        /// \return state after buf.
+        template <typename T>
+        static constexpr State update(State state, const T *buf, size_t len)
+        {
+            size_t i = 0;
+            size_t b = state.len%N;
+
+            // Up to the first bucket, than whole steps and the rest
+            for (; i<len && b && b<N; ++i, ++b)
+                mix(state.ihash[b], static_cast<unsigned char>(buf[i]));
+            for (; i+N<=len; i+=N)
+                for (size_t k=0; k<N; ++k)
+                    mix(state.ihash[k], static_cast<unsigned char>(buf[i+k]));
+            for (size_t k=0; i<len; ++i, ++k)
+                mix(state.ihash[k], static_cast<unsigned char>(buf[i]));
+
+            state.len += len;
+            return state;
+        }
+
+        /// Returns the hash of state.
+        static constexpr Value finalize(State state)
+        {
+            Value v{};
+            for (size_t k=0; k<N; ++k) {
+                uint32_t h = state.ihash[k];
+                h += (h << 3);
+                h ^= (h >> 11);
+                h += (h << 15);
+                v.ihash[k] = h;
+            }
+            return v;
+        }
+
+        /// Returns the hash of buf.
+        ///
+        /// \param buf the bytes to be hashed (char or unsigned char).
+        /// \param len number of bytes of buf.
+        template <typename T>
+        static constexpr Value hash(const T *buf, size_t len)
+        {
+            return finalize(update(init(), buf, len));
+        }
+
+        /// Returns the hash of a null terminated string.
+        static constexpr Value hash(const char *str)
+        {
+            size_t len = 0;
+            while (str[len])
+                ++len;
+            return hash(str, len);
+        }
+
+        /// Sets ret to hash.
+        ///
+        /// \param buffer The buffer to be hashed.
+        /// \param ret the Hash where copy output to, of N buckets.
+        ///
+        /// \return ret or NULL in case of error (ret of other size).
+        static Hash* hash(const Buffer &buffer, Hash *ret)
+        {
+            if (!ret->hash || ret->hash_size != size_t(N)*4)
+                return NULL;
+
+            Value v = hash(buffer.cbuffer, buffer.len);
+            memcpy(ret->hash, v.ihash, sizeof(v.ihash));
+            return ret;
+        }
+
+    protected:
+        /// One at time step.
+        static constexpr void mix(uint32_t &h, unsigned char byte)
+        {
+            h += byte;
+            h += (h << 10);
+            h ^= (h >> 6);
+        }
 };
 
 /// \brief Class to generate Bucket One at time hashes.
@@ -144,22 +337,163 @@ class BuckedOneAtTimeHash {
                 return NULL;
 
             uint8_t buckets = ret->hash_size/4;
+            BuckedOneAtTimeHash::mix(buffer.cbuffer, buffer.len, 0,
+                ret->ihash, buckets);
+            BuckedOneAtTimeHash::finish(ret->ihash, buckets);
+
+            return ret;
+        }
+
+        /// Sets ret to hash.
+        ///
+        /// Same as hash(buffer, &ret).
+        ///
+        /// \param buffer The buffer to be hashed.
+        /// \param ret the Hash where copy output to.
+        ///
+        /// \return false in case of error (NULL ret).
+        static bool hash (
+            const Buffer &buffer,
+            Hash &ret
+        ) {
+            return BuckedOneAtTimeHash::hash(buffer, &ret) != NULL;
+        }
 
-            for (unsigned int i=0; i<buffer.len; ++i)
+        /// Restarts a hash in progress.
+        ///
+        /// \param state the state, keeps its number of buckets.
+        ///
+        /// \return false in case of error (NULL state).
+        static bool init (
+            HashState &state
+        ) {
+            if (!state.hash.hash_size || !state.hash.hash)
+                return false;
+            bzero(state.hash.hash, state.hash.hash_size);
+            state.len = 0;
+            return true;
+        }
+
+        /// Mixes a buffer into a hash in progress.
+        ///
+        /// Hashing a buffer in many pieces, in order, gives the same hash of
+        /// hashing it whole.
+        ///
+        /// \param state the state to be updated.
+        /// \param buffer the next bytes.
+        ///
+        /// \return false in case of error (NULL state).
+        static bool update (
+            HashState &state,
+            const Buffer &buffer
+        ) {
+            if (!state.hash.hash_size || !state.hash.hash)
+                return false;
+            BuckedOneAtTimeHash::mix(buffer.cbuffer, buffer.len, state.len,
+                state.hash.ihash, state.hash.hash_size/4);
+            state.len += buffer.len;
+            return true;
+        }
+
+        /// Sets ret to the hash of a state.
+        ///
+        /// The state is kept, so it may be updated further.
+        ///
+        /// \param state the hash in progress.
+        /// \param ret the Hash where copy output to, resized to the state.
+        ///
+        /// \return ret or NULL in case of error (NULL state).
+        static Hash* finalize (
+            const HashState &state,
+            Hash *ret
+        ) {
+            if (!state.hash.hash_size || !state.hash.hash)
+                return NULL;
+            (*ret) = state.hash;
+            BuckedOneAtTimeHash::finish(ret->ihash, ret->hash_size/4);
+            return ret;
+        }
+
+        /// Hashes many buffers at once.
+        ///
+        /// Same as calling hash(buffers[i], &rets[i]) for each buffer, but
+        /// 8 (AVX2) or 16 (AVX-512) buffers are hashed at once, one per SIMD
+        /// lane, masking the lanes of the buffers already done.
+        ///
+        /// \param buffers array of n buffers to be hashed.
+        /// \param rets array of n hashes where to copy output to, all with
+        /// the same size.
+        /// \param n number of buffers.
+        ///
+        /// \return false in case of error (rets of different sizes), rets
+        /// are left untouched.
+        static bool hash (
+            const Buffer *buffers,
+            Hash *rets,
+            size_t n
+        ) {
+            if (!n)
+                return true;
+            for (size_t k=0; k<n; ++k)
+                if (!rets[k].hash_size || !rets[k].hash ||
+                    rets[k].hash_size != rets[0].hash_size)
+                    return false;
+
+            size_t k = HTKernels::oneAtTimeHash(buffers, rets, n,
+                rets[0].hash_size/4);
+            for (; k<n; ++k)
+                BuckedOneAtTimeHash::hash(buffers[k], &rets[k]);
+            return true;
+        }
+
+    protected:
+        /// Mixes buf into the buckets, its first byte being byte offset of
+        /// the whole hashed data.
+        static void mix(const unsigned char *buf, size_t len, size_t offset,
+            uint32_t *ihash, uint8_t buckets)
+        {
+            // Up to the first bucket one at time, so the SIMD steps start
+            // on it
+            size_t done = 0;
+            for (size_t b=offset%buckets; b && b<buckets && done<len; ++b)
             {
-                ret->ihash[i%buckets] += buffer.cbuffer[i];
-                ret->ihash[i%buckets] += (ret->ihash[i%buckets] << 10);
-                ret->ihash[i%buckets] ^= (ret->ihash[i%buckets] >> 6);
+                ihash[b] += buf[done++];
+                ihash[b] += (ihash[b] << 10);
+                ihash[b] ^= (ihash[b] >> 6);
             }
+            buf += done;
+            len -= done;
+
+            // Byte i goes to bucket i%buckets, so each step of buckets bytes
+            // updates every bucket once: one SIMD lane per bucket
+            done = HTKernels::oneAtTimeMix(buf, len, ihash, buckets);
+            BuckedOneAtTimeHash::mixScalar(buf, done, len, ihash, buckets);
+        }
 
+        /// Final avalanche of the buckets.
+        static void finish(uint32_t *ihash, uint8_t buckets)
+        {
             for (unsigned int i=0; i<buckets; ++i)
             {
-                ret->ihash[i] += (ret->ihash[i] << 3);
-                ret->ihash[i] ^= (ret->ihash[i] >> 11);
-                ret->ihash[i] += (ret->ihash[i] << 15);
+                ihash[i] += (ihash[i] << 3);
+                ihash[i] ^= (ihash[i] >> 11);
+                ihash[i] += (ihash[i] << 15);
             }
+        }
 
-            return ret;
+        /// Mixes bytes [from, len) of buf, one at time.
+        static void mixScalar(const unsigned char *buf, size_t from,
+            size_t len, uint32_t *ihash, uint8_t buckets)
+        {
+            // The bucket wraps, instead of a modulo per byte
+            for (size_t i=from, b=from%buckets; i<len; ++i)
+            {
+                ihash[b] += buf[i];
+                ihash[b] += (ihash[b] << 10);
+                ihash[b] ^= (ihash[b] >> 6);
+                if (++b == buckets)
+                    b = 0;
+            }
         }
 };
 
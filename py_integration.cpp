@@ -3,6 +3,7 @@
 #include "ht_file_versioning.h"
 
 #include "htb64.cpp"
+#include "ht_kernels.cpp"
 #include "ht_file_versioning.cpp"
 
 extern "C" {
@@ -39,6 +40,23 @@ PY_HTFileVersioning_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 static int
 PY_HTFileVersioning_init(PY_HTFileVersioning *self, PyObject *args, PyObject *kwds)
 {
+    static char *kwlist[] = {(char*)"bits", NULL};
+    unsigned PY_LONG_LONG bits = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|K", kwlist, &bits))
+        return -1;
+
+    if (bits) {
+        try {
+            HTFileVersioning *fv = new HTFileVersioning(uint64_t(bits));
+            delete self->fv;
+            self->fv = fv;
+        } catch (const char *e) {
+            PyErr_SetString(PyExc_ValueError, e);
+            return -1;
+        }
+    }
+
     self->fv->reset();
     return 0;
 }
@@ -131,9 +149,14 @@ PY_HTFileVersioning_setHTable(PY_HTFileVersioning* self, PyObject *args)
 
     if (PyString_Check(fnamel))
     {
-        self->fv->setHTable(
-            std::string(PyString_AS_STRING(fnamel))
-        );
+        try {
+            self->fv->setHTable(
+                std::string(PyString_AS_STRING(fnamel))
+            );
+        } catch (const char *e) {
+            PyErr_SetString(PyExc_ValueError, e);
+            return NULL;
+        }
 
         Py_RETURN_NONE;
     }
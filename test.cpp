@@ -7,8 +7,15 @@
 #include <execinfo.h>
 #include <signal.h>
 
+#include <set>
+#include <thread>
+
 #include "htb64.h"
 #include "ht_file_versioning.h"
+#include "ht_kernels.h"
+#include "ht_cuckoo_versioning.h"
+#include "ht_fuse_versioning.h"
+#include "ht_exact_versioning.h"
 #include "one_at_time.hpp"
 
 //  ____       _              ____  _                   _ 
@@ -154,6 +161,165 @@ TEST(TESTOneAtTimeHash, assert_hashing) {
     }
 }
 
+TEST(TESTOneAtTimeHash, simd_matches_bytewise) {
+    unsigned char buf[300];
+    for (unsigned a=0; a<sizeof(buf); a++)
+        buf[a] = a*131 + (a>>3);
+
+    for (uint8_t buckets=1; buckets<=24; buckets++) {
+        for (size_t len=0; len<=sizeof(buf); len+=7) {
+            std::vector<uint32_t> ref(buckets, 0);
+
+            for (size_t i=0; i<len; i++) {
+                ref[i%buckets] += buf[i];
+                ref[i%buckets] += (ref[i%buckets] << 10);
+                ref[i%buckets] ^= (ref[i%buckets] >> 6);
+            }
+            for (unsigned i=0; i<buckets; i++) {
+                ref[i] += (ref[i] << 3);
+                ref[i] ^= (ref[i] >> 11);
+                ref[i] += (ref[i] << 15);
+            }
+
+            Hash h(buckets);
+            Buffer b(buf, len);
+            BuckedOneAtTimeHash::hash(b, &h);
+            ASSERT_EQ(memcmp(h.hash, &ref[0], h.hash_size), 0);
+        }
+    }
+}
+
+TEST(TESTOneAtTimeHash, fixed_matches_runtime) {
+    // Hashed at compile time
+    constexpr FixedBuckedOneAtTimeHash<4>::Value hosts =
+        FixedBuckedOneAtTimeHash<4>::hash("/etc/hosts");
+    constexpr FixedBuckedOneAtTimeHash<4>::State etc =
+        FixedBuckedOneAtTimeHash<4>::update(
+            FixedBuckedOneAtTimeHash<4>::init(), "/etc/", 5);
+    constexpr FixedBuckedOneAtTimeHash<4>::Value split =
+        FixedBuckedOneAtTimeHash<4>::finalize(
+            FixedBuckedOneAtTimeHash<4>::update(etc, "hosts", 5));
+    static_assert(hosts[0] == split[0] && hosts[3] == split[3],
+        "prefix state must not change the hash");
+
+    uint32_t hash[4];
+    HTFileVersioning::hashFile("/etc/hosts", hash);
+    ASSERT_EQ(memcmp(hash, hosts.ihash, sizeof(hash)), 0);
+
+    unsigned char buf[100];
+    for (unsigned a=0; a<sizeof(buf); a++)
+        buf[a] = a*59 + 7;
+    for (size_t len=0; len<=sizeof(buf); len++) {
+        Buffer b(buf, len);
+        Hash h3(3), f3(3), h8(8), f8(8);
+
+        BuckedOneAtTimeHash::hash(b, h3);
+        BuckedOneAtTimeHash::hash(b, h8);
+        ASSERT_TRUE(FixedBuckedOneAtTimeHash<3>::hash(b, &f3) != NULL);
+        ASSERT_TRUE(FixedBuckedOneAtTimeHash<8>::hash(b, &f8) != NULL);
+        ASSERT_EQ(memcmp(h3.hash, f3.hash, h3.hash_size), 0);
+        ASSERT_EQ(memcmp(h8.hash, f8.hash, h8.hash_size), 0);
+    }
+    Hash wrong(5);
+    ASSERT_TRUE(FixedBuckedOneAtTimeHash<8>::hash(Buffer(buf, 10), &wrong) == NULL);
+}
+
+TEST(TESTOneAtTimeHash, state_resumes_prefixes) {
+    unsigned char buf[200];
+    for (unsigned a=0; a<sizeof(buf); a++)
+        buf[a] = a*71 + 3;
+
+    for (uint8_t buckets=1; buckets<=16; buckets++) {
+        for (size_t cut=0; cut<=sizeof(buf); cut+=13) {
+            Hash whole(buckets), resumed;
+            BuckedOneAtTimeHash::hash(Buffer(buf, sizeof(buf)), whole);
+
+            // A prefix state, updated in uneven pieces after a copy
+            HashState prefix(buckets);
+            ASSERT_TRUE(BuckedOneAtTimeHash::update(prefix, Buffer(buf, cut)));
+            HashState state(prefix);
+            for (size_t at=cut; at<sizeof(buf); at+=buckets+3) {
+                size_t len = sizeof(buf)-at < size_t(buckets+3) ?
+                    sizeof(buf)-at : buckets+3;
+                BuckedOneAtTimeHash::update(state, Buffer(buf+at, len));
+            }
+            ASSERT_TRUE(BuckedOneAtTimeHash::finalize(state, &resumed) != NULL);
+            ASSERT_EQ(resumed.hash_size, whole.hash_size);
+            ASSERT_EQ(memcmp(resumed.hash, whole.hash, whole.hash_size), 0);
+            ASSERT_EQ(prefix.len, cut);
+        }
+    }
+
+    // Tree walk: the directory state is hashed once
+    HTFileVersioning ht;
+    HashState dir(4);
+    BuckedOneAtTimeHash::update(dir, Buffer("/srv/app/releases/2024/", 23));
+    const char *leaves[] = {"a.txt", "b.txt", "lib/c.so"};
+    for (int k=0; k<3; k++) {
+        HashState leaf(dir);
+        Hash h;
+        BuckedOneAtTimeHash::update(leaf, Buffer(leaves[k], strlen(leaves[k])));
+        ht.addHash(*BuckedOneAtTimeHash::finalize(leaf, &h));
+    }
+    ASSERT_TRUE(ht.checkFile("/srv/app/releases/2024/a.txt"));
+    ASSERT_TRUE(ht.checkFile("/srv/app/releases/2024/lib/c.so"));
+    ASSERT_FALSE(ht.checkFile("/srv/app/releases/2024/c.txt"));
+    ASSERT_THROW(ht.checkHash(Hash(3)), const char*);
+}
+
+TEST(TESTOneAtTimeHash, inline_hash_copies_and_moves) {
+    const char *str = "/usr/share/some/long/path/file.txt";
+    Buffer b(str, strlen(str));
+
+    for (uint8_t buckets=1; buckets<=Hash::inlineBuckets*2; buckets++) {
+        Hash h(buckets);
+        ASSERT_TRUE(BuckedOneAtTimeHash::hash(b, h));
+        ASSERT_EQ(h.isInline(), buckets <= Hash::inlineBuckets);
+
+        Hash copy(h);
+        ASSERT_EQ(copy.hash_size, h.hash_size);
+        ASSERT_NE(copy.hash, h.hash);
+        ASSERT_EQ(memcmp(copy.hash, h.hash, h.hash_size), 0);
+
+        Hash moved(std::move(copy));
+        ASSERT_EQ(copy.hash, (void*)NULL);
+        ASSERT_EQ(copy.hash_size, 0u);
+        ASSERT_EQ(moved.isInline(), buckets <= Hash::inlineBuckets);
+        ASSERT_EQ(memcmp(moved.hash, h.hash, h.hash_size), 0);
+
+        Hash small(1);
+        small = moved;
+        ASSERT_EQ(memcmp(small.hash, h.hash, h.hash_size), 0);
+        small = std::move(moved);
+        ASSERT_EQ(moved.hash, (void*)NULL);
+        ASSERT_EQ(memcmp(small.hash, h.hash, h.hash_size), 0);
+    }
+}
+
+TEST(TESTOneAtTimeHash, multi_matches_single) {
+    unsigned char buf[400];
+    for (unsigned a=0; a<sizeof(buf); a++)
+        buf[a] = a*197 + (a>>2);
+
+    for (uint8_t buckets=1; buckets<=12; buckets++) {
+        for (size_t n=1; n<=40; n+=3) {
+            std::vector<Buffer> bs(n);
+            std::vector<Hash> hs(n), ref(n);
+
+            for (size_t k=0; k<n; k++) {
+                // Lengths from empty to whole buffer, with shared offsets
+                bs[k] = Buffer(buf + k%7, (k*37 + buckets*5) % 390);
+                hs[k] = Hash(buckets);
+                ref[k] = Hash(buckets);
+                BuckedOneAtTimeHash::hash(bs[k], &ref[k]);
+            }
+            ASSERT_TRUE(BuckedOneAtTimeHash::hash(&bs[0], &hs[0], n));
+            for (size_t k=0; k<n; k++)
+                ASSERT_EQ(memcmp(hs[k].hash, ref[k].hash, ref[k].hash_size), 0);
+        }
+    }
+}
+
 //  _____         _   _____                     _ _             
 // |_   _|__  ___| |_| ____|_ __   ___ ___   __| (_)_ __   __ _ 
 //   | |/ _ \/ __| __|  _| | '_ \ / __/ _ \ / _` | | '_ \ / _` |
@@ -355,6 +521,192 @@ TEST(TESTHTDataCompress, assert_stable) {
     }
 }
 
+TEST(TESTHTDataCompress, big_buffers_roundtrip) {
+    // Runs, repeats and noise, long enough for a dictionary of 2^20 codes
+    const size_t il = 4<<20;
+    std::vector<uint8_t> in(il), back(il);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t a=0; a<il; a++) {
+        x ^= x<<13; x ^= x>>7; x ^= x<<17;
+        in[a] = (a/4096)%3 == 0 ? uint8_t(x) :
+            (a/4096)%3 == 1 ? uint8_t(a/512) : in[a-4096];
+    }
+
+    uint8_t *o = NULL;
+    size_t ol = 0;
+    HTDataCompress::compress(&in[0], il, &o, &ol);
+    ASSERT_LT(ol, il);
+    HTDataCompress::decompress(o, ol, &back[0], il);
+    ASSERT_TRUE(in == back);
+
+    // A shorter output keeps the head
+    std::vector<uint8_t> head(1000);
+    HTDataCompress::decompress(o, ol, &head[0], head.size());
+    ASSERT_TRUE(std::equal(head.begin(), head.end(), in.begin()));
+    delete[] o;
+
+    // Codes past the dictionary are refused
+    uint8_t bad[] = {9, 0x2C, 0x01};
+    ASSERT_THROW(HTDataCompress::decompress(bad, sizeof(bad), &head[0],
+        head.size()), const char*);
+}
+
+TEST(TESTHTDataCompress, var_codes_clear_dictionary) {
+    // Runs, repeats and noise, enough to fill a dictionary of 2^20 codes
+    const size_t il = 6<<20;
+    std::vector<uint8_t> in(il), back(il);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t a=0; a<il; a++) {
+        x ^= x<<13; x ^= x>>7; x ^= x<<17;
+        in[a] = (a/4096)%4 < 2 ? uint8_t(x) :
+            (a/4096)%4 == 2 ? uint8_t(a/512) : in[a-4096];
+    }
+
+    // Variable width codes clear their dictionary on the way, and still
+    // come out smaller
+    HTDataCompress::Codec codecs[] = {HTDataCompress::CODEC_LZW,
+        HTDataCompress::CODEC_LZW_VAR};
+    size_t sizes[2];
+    std::vector<uint8_t> head(1000);
+    for (int c=0; c<2; c++) {
+        uint8_t *o = NULL;
+        size_t ol = 0;
+        HTDataCompress::compress(&in[0], il, &o, &ol, codecs[c]);
+        ASSERT_LT(ol, il);
+        bzero(&back[0], il);
+        HTDataCompress::decompress(o, ol, &back[0], il, codecs[c]);
+        ASSERT_TRUE(in == back);
+
+        // A shorter output keeps the head
+        HTDataCompress::decompress(o, ol, &head[0], head.size(), codecs[c]);
+        ASSERT_TRUE(std::equal(head.begin(), head.end(), in.begin()));
+        sizes[c] = ol;
+
+        // The j-th code after a clear is as wide as the largest code the
+        // dictionary may hold by then
+        if (codecs[c] == HTDataCompress::CODEC_LZW_VAR) {
+            ASSERT_EQ(o[0], HTDataCompress::lzwVarMaxBits);
+            size_t clears = 0;
+            uint64_t j = 0, pos = 0, end = uint64_t(ol-1)*8;
+            for (;;) {
+                unsigned w = 64 - __builtin_clzll(256 + j);
+                if (w > o[0])
+                    w = o[0];
+                if (pos + w > end)
+                    break;
+                uint32_t code = 0;
+                for (unsigned b=0; b<w; b++, pos++)
+                    code |= uint32_t(o[1 + pos/8]>>(pos%8) & 1) << b;
+                j = (code == HTDataCompress::lzwClear) ? 0 : j+1;
+                clears += (j == 0);
+            }
+            ASSERT_GE(clears, 1u);
+        }
+        delete[] o;
+    }
+    ASSERT_LT(sizes[1], sizes[0]);
+
+    uint8_t badVar[] = {20, 0x2C, 0x03};
+    ASSERT_THROW(HTDataCompress::decompress(badVar, sizeof(badVar),
+        &head[0], head.size(), HTDataCompress::CODEC_LZW_VAR), const char*);
+}
+
+TEST(TESTHTDataCompress, packs_every_width) {
+    uint64_t x = 2463534242ULL;
+    for (uint8_t w=1; w<=32; w++) {
+        for (size_t n=0; n<40; n+=3) {
+            std::vector<uint32_t> codes(n+1), back(n+1, 0xDEADBEEF);
+            for (size_t a=0; a<n; a++) {
+                x ^= x<<13; x ^= x>>7; x ^= x<<17;
+                codes[a] = uint32_t(x) & uint32_t((uint64_t(1)<<w)-1);
+            }
+            // Exact size, guarded by a canary
+            size_t len = (n*w+7)/8;
+            std::vector<uint8_t> packed(len+1, 0xA5);
+            HTKernels::packBits(&codes[0], n, w, &packed[0]);
+            ASSERT_EQ(packed[len], 0xA5);
+            HTKernels::unpackBits(&packed[0], n, w, &back[0]);
+            ASSERT_TRUE(std::equal(codes.begin(), codes.begin()+n,
+                back.begin()));
+            ASSERT_EQ(back[n], 0xDEADBEEF);
+        }
+    }
+}
+
+TEST(TESTHTDataCompress, runs_roundtrip) {
+    // A largest code of 256 needs 9 bits
+    const char *runs[] = {"AAA", "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA"};
+    for (int a=0; a<2; a++) {
+        size_t il = strlen(runs[a]), ol;
+        uint8_t *o = NULL;
+        std::vector<uint8_t> back(il);
+        HTDataCompress::compress((uint8_t*)runs[a], il, &o, &ol);
+        HTDataCompress::decompress(o, ol, &back[0], il);
+        ASSERT_EQ(memcmp(&back[0], runs[a], il), 0);
+        delete[] o;
+    }
+}
+
+TEST(TESTHTDataCompress, codecs_roundtrip_and_auto_picks_smallest) {
+    const size_t il = 1<<16;
+    std::vector<uint8_t> empty(il), sparse(il), dense(il);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t a=0; a<il; a++) {
+        x ^= x<<13; x ^= x>>7; x ^= x<<17;
+        dense[a] = uint8_t(x);
+        if (a%97 == 0)
+            sparse[a] = uint8_t(1<<(a%8));
+    }
+    std::vector<uint8_t> *inputs[] = {&empty, &sparse, &dense};
+
+    HTDataCompress::Codec codecs[] = {HTDataCompress::CODEC_LZW,
+        HTDataCompress::CODEC_LZW_VAR, HTDataCompress::CODEC_RAW,
+        HTDataCompress::CODEC_RLE0, HTDataCompress::CODEC_SPARSE,
+        HTDataCompress::CODEC_LZMA, HTDataCompress::CODEC_RICE};
+    size_t smallest[3] = {il, il, il};
+    for (int c=0; c<7; c++) {
+        if (!HTDataCompress::hasCodec(codecs[c]))
+            continue;
+        for (int i=0; i<3; i++) {
+            uint8_t *o = NULL;
+            size_t ol = 0;
+            ASSERT_EQ(HTDataCompress::compress(&(*inputs[i])[0], il, &o, &ol,
+                codecs[c]), codecs[c]);
+            std::vector<uint8_t> back(il, 0xA5);
+            HTDataCompress::decompress(o, ol, &back[0], il, codecs[c]);
+            ASSERT_TRUE(back == *inputs[i]);
+            smallest[i] = std::min(smallest[i], ol);
+            delete[] o;
+        }
+    }
+    ASSERT_FALSE(HTDataCompress::hasCodec(HTDataCompress::CODEC_AUTO));
+
+    // Sparse bits get the smallest codec, noise is stored as is
+    uint8_t *o = NULL;
+    size_t ol = 0;
+    ASSERT_NE(HTDataCompress::compress(&sparse[0], il, &o, &ol,
+        HTDataCompress::CODEC_AUTO), HTDataCompress::CODEC_RAW);
+    ASSERT_EQ(ol, smallest[1]);
+    delete[] o;
+    ASSERT_EQ(HTDataCompress::compress(&dense[0], il, &o, &ol,
+        HTDataCompress::CODEC_AUTO), HTDataCompress::CODEC_RAW);
+    ASSERT_EQ(ol, il);
+    delete[] o;
+
+    // Without a budget only the linear codecs are tried
+    HTDataCompress::Codec picked = HTDataCompress::compress(&sparse[0], il,
+        &o, &ol, HTDataCompress::CODEC_AUTO, 0);
+    ASSERT_NE(picked, HTDataCompress::CODEC_RAW);
+    ASSERT_NE(picked, HTDataCompress::CODEC_LZW_VAR);
+    ASSERT_NE(picked, HTDataCompress::CODEC_LZMA);
+    delete[] o;
+
+    // An empty table exports an empty payload, and still loads
+    HTFileVersioning fv(1000, 0.01), back(1000, 0.01);
+    back.setHTable(fv.getHTable());
+    ASSERT_FALSE(back.checkFile("/etc/hosts"));
+}
+
 //  _____         _   _______     __        
 // |_   _|__  ___| |_|  ___\ \   / /__ _ __ 
 //   | |/ _ \/ __| __| |_   \ \ / / _ \ '__|
@@ -591,15 +943,15 @@ TEST(TESTHTFileVersioning, test_merge_works) {
     fvf.mergeHTable(fv1.getHTable());
     fvf.mergeHTable(fv2.getHTable());
 
-    uint8_t *fv1tal = new uint8_t[HTFileVersioning::getHTableBytesLen()]();
-    uint8_t *fv2tal = new uint8_t[HTFileVersioning::getHTableBytesLen()]();
-    uint8_t *fvftal = new uint8_t[HTFileVersioning::getHTableBytesLen()]();
+    uint8_t *fv1tal = new uint8_t[fv1.getHTableBytesLen()]();
+    uint8_t *fv2tal = new uint8_t[fv1.getHTableBytesLen()]();
+    uint8_t *fvftal = new uint8_t[fv1.getHTableBytesLen()]();
 
-    fv1.getRawHTable(fv1tal, HTFileVersioning::getHTableBytesLen());
-    fv2.getRawHTable(fv2tal, HTFileVersioning::getHTableBytesLen());
-    fvf.getRawHTable(fvftal, HTFileVersioning::getHTableBytesLen());
+    fv1.getRawHTable(fv1tal, fv1.getHTableBytesLen());
+    fv2.getRawHTable(fv2tal, fv1.getHTableBytesLen());
+    fvf.getRawHTable(fvftal, fv1.getHTableBytesLen());
 
-    for(unsigned a=0; a<HTFileVersioning::getHTableBytesLen(); a++) {
+    for(unsigned a=0; a<fv1.getHTableBytesLen(); a++) {
         ASSERT_EQ(fvftal[a], fv1tal[a]|fv2tal[a]);
     }
 
@@ -622,4 +974,1111 @@ TEST(TESTHTFileVersioning, test_merge_works) {
     }
     EXPECT_EQ(error, 0);
     ASSERT_LT(error, nelt);
-}
\ No newline at end of file
+}
+TEST(TESTHTFileVersioning, bloom_reaches_fpr) {
+    const unsigned total = 2000;
+    const unsigned probes = 20000;
+    char path[64];
+
+    HTFileVersioning fv(total, 0.01);
+    ASSERT_GT(fv.getProbes(), 1);
+    ASSERT_GE(fv.getHTableBitsLen(), 9.58*total);
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/srv/app/releases/%u/file.cpp", a);
+        fv.addFile(path);
+    }
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/srv/app/releases/%u/file.cpp", a);
+        ASSERT_TRUE(fv.checkFile(path));
+    }
+
+    unsigned errors = 0;
+    for (unsigned a=0; a<probes; a++) {
+        snprintf(path, sizeof(path), "/srv/app/releases/%u/file.h", a);
+        if (fv.checkFile(path))
+            errors++;
+    }
+    // fpr is an average: a table sized right at it gets 1% here, give or
+    // take the noise of 20000 checks, so the bound keeps a margin
+    ASSERT_LT(errors, probes*0.015);
+}
+
+TEST(TESTHTFileVersioning, bloom_export_keeps_geometry) {
+    const unsigned total = 500;
+    char path[64];
+
+    HTFileVersioning fv1(total, 0.001), fv2, fv3;
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/etc/conf.d/%u.conf", a);
+        fv1.addFile(path);
+    }
+
+    std::string tabela1 = fv1.getHTable();
+    fv2.setHTable(tabela1);
+
+    ASSERT_EQ(fv1.getProbes(), fv2.getProbes());
+    ASSERT_EQ(fv1.getHTableBitsLen(), fv2.getHTableBitsLen());
+    ASSERT_EQ(tabela1, fv2.getHTable());
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/etc/conf.d/%u.conf", a);
+        ASSERT_TRUE(fv2.checkFile(path));
+    }
+
+    ASSERT_ANY_THROW(fv3.mergeHTable(tabela1));
+    fv2.mergeHTable(tabela1);
+    ASSERT_EQ(tabela1, fv2.getHTable());
+}
+
+TEST(TESTHTFileVersioning, large_sparse_export_is_small) {
+    // 32 MiB of bits, far past what the slower codecs are tried on
+    HTFileVersioning fv1(uint64_t(1)<<28), fv2(uint64_t(1)<<28);
+    char path[64];
+
+    for (unsigned a=0; a<20; a++) {
+        snprintf(path, sizeof(path), "/var/lib/%u.db", a);
+        fv1.addFile(path);
+    }
+
+    std::string tabela1 = fv1.getHTable();
+    ASSERT_LT(tabela1.size(), 4096u);
+    ASSERT_EQ(tabela1, fv1.getHTable());
+
+    fv2.setHTable(tabela1);
+    ASSERT_EQ(tabela1, fv2.getHTable());
+    for (unsigned a=0; a<20; a++) {
+        snprintf(path, sizeof(path), "/var/lib/%u.db", a);
+        ASSERT_TRUE(fv2.checkFile(path));
+    }
+}
+
+TEST(TESTHTFileVersioning, sized_tables_coexist) {
+    const unsigned total = 300;
+    char path[64];
+
+    HTFileVersioning small(1000), big(uint64_t(1)<<20), fv;
+
+    ASSERT_EQ(small.getHTableBitsLen(), 1000u);
+    ASSERT_EQ(small.getHTableBytesLen(), 125u);
+    ASSERT_EQ(big.getHTableBitsLen(), uint64_t(1)<<20);
+    ASSERT_EQ(big.getHTableBytesLen(), uint64_t(1)<<17);
+    ASSERT_EQ(fv.getHTableBitsLen(), HTFileVersioning::legacyBitsLen);
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/var/lib/catalog/%u.json", a);
+        small.addFile(path);
+        big.addFile(path);
+    }
+
+    fv.setHTable(big.getHTable());
+    ASSERT_EQ(fv.getHTableBitsLen(), big.getHTableBitsLen());
+
+    unsigned errors = 0;
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/var/lib/catalog/%u.json", a);
+        ASSERT_TRUE(small.checkFile(path));
+        ASSERT_TRUE(fv.checkFile(path));
+
+        snprintf(path, sizeof(path), "/var/lib/catalog/%u.yaml", a);
+        if (fv.checkFile(path))
+            errors++;
+    }
+    EXPECT_EQ(errors, 0u);
+
+    ASSERT_ANY_THROW(small.mergeHTable(big.getHTable()));
+    ASSERT_ANY_THROW(HTFileVersioning(uint64_t(0)));
+}
+
+TEST(TESTHTFileVersioning, blocked_layout_works) {
+    const unsigned total = 5000;
+    const unsigned probes = 50000;
+    char path[64];
+
+    HTFileVersioning fv(total, 0.01, HTFileVersioning::LAYOUT_BLOCKED), fv2;
+    ASSERT_EQ(fv.getLayout(), HTFileVersioning::LAYOUT_BLOCKED);
+    ASSERT_EQ(fv.getHTableBitsLen()%HTFileVersioning::blockBitsLen, 0u);
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/usr/share/doc/%u/README", a);
+        fv.addFile(path);
+    }
+
+    fv2.setHTable(fv.getHTable());
+    ASSERT_EQ(fv2.getLayout(), HTFileVersioning::LAYOUT_BLOCKED);
+    ASSERT_EQ(fv2.getProbes(), fv.getProbes());
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/usr/share/doc/%u/README", a);
+        ASSERT_TRUE(fv.checkFile(path));
+        ASSERT_TRUE(fv2.checkFile(path));
+    }
+
+    unsigned errors = 0;
+    for (unsigned a=0; a<probes; a++) {
+        snprintf(path, sizeof(path), "/usr/share/doc/%u/COPYING", a);
+        if (fv2.checkFile(path))
+            errors++;
+    }
+    ASSERT_LT(errors, probes*0.015);
+
+    HTFileVersioning flat(total, 0.01);
+    ASSERT_ANY_THROW(flat.mergeHTable(fv.getHTable()));
+}
+
+TEST(TESTHTFileVersioning, batch_matches_single) {
+    const unsigned total = 1000;
+    std::vector<std::string> names;
+    std::vector<const char*> paths;
+
+    for (unsigned a=0; a<total; a++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/opt/pkg/%u/lib%u.so", a%37, a);
+        names.push_back(path);
+    }
+    for (unsigned a=0; a<total; a++)
+        paths.push_back(names[a].c_str());
+
+    HTFileVersioning *singles[] = {
+        new HTFileVersioning(),
+        new HTFileVersioning(total/2, 0.01),
+        new HTFileVersioning(total/2, 0.01, HTFileVersioning::LAYOUT_BLOCKED)
+    };
+    HTFileVersioning *batches[] = {
+        new HTFileVersioning(),
+        new HTFileVersioning(total/2, 0.01),
+        new HTFileVersioning(total/2, 0.01, HTFileVersioning::LAYOUT_BLOCKED)
+    };
+
+    for (unsigned t=0; t<sizeof(singles)/sizeof(singles[0]); t++) {
+        for (unsigned a=0; a<total/2; a++)
+            singles[t]->addFile(paths[a]);
+        batches[t]->addFiles(&paths[0], total/2);
+
+        ASSERT_EQ(singles[t]->getHTable(), batches[t]->getHTable());
+
+        std::vector<uint8_t> results(total);
+        batches[t]->checkFiles(&paths[0], total, &results[0]);
+        for (unsigned a=0; a<total; a++)
+            ASSERT_EQ(results[a], singles[t]->checkFile(paths[a]));
+
+        delete singles[t];
+        delete batches[t];
+    }
+}
+
+static void concurrent_adder(HTFileVersioning *fv, unsigned id, unsigned total)
+{
+    char path[64];
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/home/worker%u/%u.dat", id, a);
+        fv->addFile(path);
+    }
+}
+
+TEST(TESTHTFileVersioning, concurrent_add_loses_nothing) {
+    const unsigned threads = 8;
+    const unsigned total = 2000;
+    char path[64];
+
+    HTFileVersioning *tables[][2] = {
+        { new HTFileVersioning(), new HTFileVersioning() },
+        {
+            new HTFileVersioning(threads*total, 0.01),
+            new HTFileVersioning(threads*total, 0.01)
+        },
+        {
+            new HTFileVersioning(threads*total, 0.01,
+                HTFileVersioning::LAYOUT_BLOCKED),
+            new HTFileVersioning(threads*total, 0.01,
+                HTFileVersioning::LAYOUT_BLOCKED)
+        }
+    };
+
+    for (unsigned t=0; t<sizeof(tables)/sizeof(tables[0]); t++) {
+        HTFileVersioning *shared = tables[t][0];
+        HTFileVersioning *serial = tables[t][1];
+
+        shared->setConcurrent(true);
+        ASSERT_TRUE(shared->isConcurrent());
+
+        std::vector<std::thread> workers;
+        for (unsigned id=0; id<threads; id++)
+            workers.push_back(std::thread(concurrent_adder, shared, id, total));
+        for (unsigned id=0; id<threads; id++)
+            workers[id].join();
+
+        for (unsigned id=0; id<threads; id++)
+            concurrent_adder(serial, id, total);
+
+        ASSERT_EQ(shared->getHTable(), serial->getHTable());
+        for (unsigned id=0; id<threads; id++) {
+            for (unsigned a=0; a<total; a++) {
+                snprintf(path, sizeof(path), "/home/worker%u/%u.dat", id, a);
+                ASSERT_TRUE(shared->checkFile(path));
+            }
+        }
+
+        delete shared;
+        delete serial;
+    }
+}
+
+TEST(TESTHTFileVersioning, combine_tables_works) {
+    const unsigned ntables = 5;
+    const uint64_t bits = 100003;
+    char path[64];
+
+    HTFileVersioning *tables[ntables];
+    std::vector<uint8_t> raws[ntables];
+
+    for (unsigned t=0; t<ntables; t++) {
+        tables[t] = new HTFileVersioning(bits);
+        for (unsigned a=0; a<20000; a++) {
+            snprintf(path, sizeof(path), "/mnt/host%u/%u", t, a*(t+1));
+            tables[t]->addFile(path);
+        }
+        raws[t].resize(tables[t]->getHTableBytesLen());
+        tables[t]->getRawHTable(&raws[t][0], raws[t].size());
+    }
+
+    const HTFileVersioning * const *others =
+        (const HTFileVersioning * const *)(tables+1);
+    std::vector<uint8_t> raw(raws[0].size());
+
+    for (int op=0; op<4; op++) {
+        HTFileVersioning fv(bits);
+        fv.setHTable(&raws[0][0], raws[0].size());
+
+        if (op == 0) fv.mergeHTables(others, ntables-1);
+        if (op == 1) fv.intersectHTables(others, ntables-1);
+        if (op == 2) fv.xorHTables(others, ntables-1);
+        if (op == 3) fv.subtractHTables(others, ntables-1);
+
+        fv.getRawHTable(&raw[0], raw.size());
+        for (size_t b=0; b<raw.size(); b++) {
+            uint8_t expected = raws[0][b];
+            for (unsigned t=1; t<ntables; t++) {
+                if (op == 0) expected |= raws[t][b];
+                if (op == 1) expected &= raws[t][b];
+                if (op == 2) expected ^= raws[t][b];
+                if (op == 3) expected &= ~raws[t][b];
+            }
+            ASSERT_EQ(raw[b], expected);
+        }
+    }
+
+    HTFileVersioning fv(bits);
+    fv.setHTable(&raws[0][0], raws[0].size());
+    fv.intersectHTable(&raws[1][0], raws[1].size());
+    fv.getRawHTable(&raw[0], raw.size());
+    for (size_t b=0; b<raw.size(); b++)
+        ASSERT_EQ(raw[b], raws[0][b]&raws[1][b]);
+
+    ASSERT_ANY_THROW(fv.mergeHTable(&raws[1][0], raws[1].size()-1));
+    HTFileVersioning other(bits+1);
+    const HTFileVersioning *pother = &other;
+    ASSERT_ANY_THROW(fv.mergeHTables(&pother, 1));
+
+    for (unsigned t=0; t<ntables; t++)
+        delete tables[t];
+}
+
+TEST(TESTHTFileVersioning, estimates_follow_load) {
+    const unsigned total = 20000;
+    const unsigned probes = 50000;
+    char path[64];
+
+    HTFileVersioning *tables[] = {
+        new HTFileVersioning(total, 0.02),
+        new HTFileVersioning(total, 0.02, HTFileVersioning::LAYOUT_BLOCKED),
+        new HTFileVersioning(uint64_t(12345))
+    };
+
+    for (unsigned t=0; t<sizeof(tables)/sizeof(tables[0]); t++) {
+        HTFileVersioning *fv = tables[t];
+
+        ASSERT_EQ(fv->popcount(), 0u);
+        ASSERT_EQ(fv->fillRatio(), 0.0);
+        ASSERT_EQ(fv->estimatedItems(), 0.0);
+
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            fv->addFile(path);
+        }
+
+        std::vector<uint8_t> raw(fv->getHTableBytesLen());
+        fv->getRawHTable(&raw[0], raw.size());
+        uint64_t count = 0;
+        for (size_t b=0; b<raw.size(); b++)
+            count += __builtin_popcount(raw[b]);
+        ASSERT_EQ(fv->popcount(), count);
+        ASSERT_DOUBLE_EQ(fv->fillRatio(), double(count)/fv->getHTableBitsLen());
+
+        if (fv->getProbes() > 1) {
+            ASSERT_NEAR(fv->estimatedItems(), total, total*0.05);
+
+            unsigned errors = 0;
+            for (unsigned a=0; a<probes; a++) {
+                snprintf(path, sizeof(path), "/data/set/%u.csv", a);
+                if (fv->checkFile(path))
+                    errors++;
+            }
+            ASSERT_NEAR(fv->estimatedFpr(), double(errors)/probes, 0.005);
+        }
+
+        delete fv;
+    }
+
+    HTFileVersioning legacy;
+    legacy.addFile("/etc/hosts");
+    ASSERT_EQ(legacy.popcount(), 1u);
+    ASSERT_NEAR(legacy.estimatedItems(), 1.0, 0.01);
+}
+
+TEST(TESTHTFileVersioning, counting_remove_works) {
+    const unsigned total = 5000;
+    char path[64];
+
+    HTCountingFileVersioning *tables[] = {
+        new HTCountingFileVersioning(total, 0.01),
+        new HTCountingFileVersioning(total, 0.01,
+            HTFileVersioning::LAYOUT_BLOCKED),
+        new HTCountingFileVersioning(uint64_t(12345)),
+        new HTCountingFileVersioning()
+    };
+
+    for (unsigned t=0; t<sizeof(tables)/sizeof(tables[0]); t++) {
+        HTCountingFileVersioning *cfv = tables[t];
+        unsigned files = cfv->getHTableBitsLen() == 4096 ? 20 : total;
+
+        for (unsigned a=0; a<files; a++) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            cfv->addFile(path);
+        }
+
+        // Bits and counters must survive a round trip
+        HTCountingFileVersioning copy;
+        copy.setHTable(cfv->getHTable());
+        ASSERT_EQ(copy.getHTableBitsLen(), cfv->getHTableBitsLen());
+        ASSERT_EQ(copy.getProbes(), cfv->getProbes());
+        ASSERT_EQ(copy.getLayout(), cfv->getLayout());
+
+        std::vector<uint8_t> raw(cfv->getHTableBytesLen());
+        std::vector<uint8_t> raw_copy(copy.getHTableBytesLen());
+        cfv->getRawHTable(&raw[0], raw.size());
+        copy.getRawHTable(&raw_copy[0], raw_copy.size());
+        ASSERT_EQ(raw, raw_copy);
+
+        // The plain export is a regular table
+        HTFileVersioning fv;
+        fv.setHTable(cfv->getBitHTable());
+        ASSERT_ANY_THROW(fv.setHTable(cfv->getHTable()));
+        ASSERT_ANY_THROW(copy.setHTable(cfv->getBitHTable()));
+
+        for (unsigned a=0; a<files; a+=2) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            ASSERT_TRUE(fv.checkFile(path));
+            ASSERT_TRUE(copy.removeFile(path));
+        }
+        for (unsigned a=1; a<files; a+=2) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            ASSERT_TRUE(copy.checkFile(path));
+        }
+        for (unsigned a=1; a<files; a+=2) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            ASSERT_TRUE(copy.removeFile(path));
+        }
+        ASSERT_EQ(copy.popcount(), 0u);
+
+        delete cfv;
+    }
+}
+
+TEST(TESTHTFileVersioning, counting_merge_saturates) {
+    const unsigned total = 3000;
+    char path[64];
+
+    HTCountingFileVersioning a(total, 0.01), b(total, 0.01);
+
+    for (unsigned f=0; f<total; f++) {
+        snprintf(path, sizeof(path), "/a/%u", f);
+        a.addFile(path);
+        snprintf(path, sizeof(path), "/b/%u", f);
+        b.addFile(path);
+    }
+
+    HTCountingFileVersioning merged(total, 0.01);
+    merged.mergeHTable(a);
+    merged.mergeHTable(b.getHTable());
+    for (unsigned f=0; f<total; f++) {
+        snprintf(path, sizeof(path), "/a/%u", f);
+        ASSERT_TRUE(merged.checkFile(path));
+        snprintf(path, sizeof(path), "/b/%u", f);
+        ASSERT_TRUE(merged.checkFile(path));
+    }
+
+    // Removing b leaves exactly a
+    merged.subtractHTable(b);
+    std::vector<uint8_t> raw_a(a.getHTableBytesLen());
+    std::vector<uint8_t> raw_m(merged.getHTableBytesLen());
+    a.getRawHTable(&raw_a[0], raw_a.size());
+    merged.getRawHTable(&raw_m[0], raw_m.size());
+    ASSERT_EQ(raw_a, raw_m);
+
+    // Saturated counters never go down
+    HTCountingFileVersioning sat(uint64_t(64));
+    for (unsigned f=0; f<20; f++)
+        sat.addFile("/etc/hosts");
+    for (unsigned f=0; f<20; f++)
+        ASSERT_TRUE(sat.removeFile("/etc/hosts"));
+    ASSERT_TRUE(sat.checkFile("/etc/hosts"));
+    ASSERT_FALSE(a.removeFile("/never/added"));
+
+    HTCountingFileVersioning other(uint64_t(12345));
+    ASSERT_ANY_THROW(merged.mergeHTable(other));
+    ASSERT_ANY_THROW(merged.subtractHTable(other));
+}
+
+TEST(TESTHTCuckooFileVersioning, beats_bloom_bits) {
+    const unsigned total = 100000;
+    const unsigned probes = 100000;
+    char path[64];
+
+    HTCuckooFileVersioning cfv(total, 0.001);
+    HTFileVersioning fv(total, 0.001);
+
+    ASSERT_LT(cfv.getHTableBitsLen(), fv.getHTableBitsLen());
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(cfv.addFile(path));
+    }
+    ASSERT_EQ(cfv.getItems(), total);
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(cfv.checkFile(path));
+    }
+
+    unsigned errors = 0;
+    for (unsigned a=0; a<probes; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.csv", a);
+        if (cfv.checkFile(path))
+            errors++;
+    }
+    ASSERT_LE(double(errors)/probes, 0.0015);
+    ASSERT_NEAR(cfv.estimatedFpr(), double(errors)/probes, 0.0005);
+
+    // Export keeps the geometry and every slot
+    HTCuckooFileVersioning copy;
+    copy.setHTable(cfv.getHTable());
+    ASSERT_EQ(copy.getBuckets(), cfv.getBuckets());
+    ASSERT_EQ(copy.getFingerprintBits(), cfv.getFingerprintBits());
+    ASSERT_EQ(copy.getItems(), cfv.getItems());
+
+    std::vector<uint8_t> raw(cfv.getHTableBytesLen());
+    std::vector<uint8_t> raw_copy(copy.getHTableBytesLen());
+    cfv.getRawHTable(&raw[0], raw.size());
+    copy.getRawHTable(&raw_copy[0], raw_copy.size());
+    ASSERT_EQ(raw, raw_copy);
+
+    HTFileVersioning plain;
+    ASSERT_ANY_THROW(plain.setHTable(cfv.getHTable()));
+    ASSERT_ANY_THROW(copy.setHTable(plain.getHTable()));
+
+    for (unsigned a=0; a<total; a+=2) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(copy.removeFile(path));
+    }
+    ASSERT_EQ(copy.getItems(), total/2);
+    for (unsigned a=1; a<total; a+=2) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(copy.checkFile(path));
+    }
+
+    copy.reset();
+    ASSERT_EQ(copy.getItems(), 0u);
+    ASSERT_FALSE(copy.checkFile("/data/set/1.parquet"));
+    ASSERT_FALSE(copy.removeFile("/data/set/1.parquet"));
+}
+
+TEST(TESTHTCuckooFileVersioning, full_table_is_untouched) {
+    char path[64];
+    HTCuckooFileVersioning cfv;
+    unsigned added = 0;
+
+    for (;; added++) {
+        snprintf(path, sizeof(path), "/full/%u", added);
+
+        std::vector<uint8_t> before(cfv.getHTableBytesLen());
+        cfv.getRawHTable(&before[0], before.size());
+        if (cfv.addFile(path))
+            continue;
+
+        std::vector<uint8_t> after(cfv.getHTableBytesLen());
+        cfv.getRawHTable(&after[0], after.size());
+        ASSERT_EQ(before, after);
+        break;
+    }
+
+    ASSERT_EQ(cfv.getItems(), added);
+    ASSERT_GT(cfv.loadFactor(), 0.85);
+    for (unsigned a=0; a<added; a++) {
+        snprintf(path, sizeof(path), "/full/%u", a);
+        ASSERT_TRUE(cfv.checkFile(path));
+    }
+
+    ASSERT_ANY_THROW(HTCuckooFileVersioning(0, 0.01));
+    ASSERT_ANY_THROW(HTCuckooFileVersioning(10, 1.0));
+}
+
+TEST(TESTHTCuckooFileVersioning, blocked_buckets_stay_in_a_line) {
+    const unsigned total = 5000;
+    const double fprs[] = {0.03, 0.01, 0.003, 0.001, 0.0002};
+    char path[64];
+
+    for (int r=0; r<5; r++) {
+        HTCuckooFileVersioning cfv(total, fprs[r],
+            HTFileVersioning::LAYOUT_BLOCKED);
+        unsigned width = HTCuckooFileVersioning::slots*cfv.getFingerprintBits();
+
+        ASSERT_EQ(cfv.getLayout(), HTFileVersioning::LAYOUT_BLOCKED);
+        for (uint64_t b=0; b<cfv.getBuckets(); b++) {
+            uint64_t bit = cfv.getBucketBit(b);
+            ASSERT_EQ(bit/HTCuckooFileVersioning::lineBitsLen,
+                (bit+width-1)/HTCuckooFileVersioning::lineBitsLen);
+            ASSERT_LE(bit+width, cfv.getHTableBitsLen());
+        }
+
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            ASSERT_TRUE(cfv.addFile(path));
+        }
+
+        HTCuckooFileVersioning copy;
+        copy.setHTable(cfv.getHTable());
+        ASSERT_EQ(copy.getLayout(), HTFileVersioning::LAYOUT_BLOCKED);
+        ASSERT_EQ(copy.getBuckets(), cfv.getBuckets());
+        ASSERT_EQ(copy.getItems(), cfv.getItems());
+        ASSERT_EQ(copy.getHTable(), cfv.getHTable());
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+            ASSERT_TRUE(copy.checkFile(path));
+            if (a%2)
+                ASSERT_TRUE(copy.removeFile(path));
+        }
+        ASSERT_EQ(copy.getItems(), total/2);
+    }
+
+    // The line tail left by 13 bits fingerprints takes a 14th bit
+    HTCuckooFileVersioning narrow(total, 0.001);
+    HTCuckooFileVersioning wide(total, 0.001, HTFileVersioning::LAYOUT_BLOCKED);
+    ASSERT_EQ(narrow.getFingerprintBits(), 13);
+    ASSERT_EQ(wide.getFingerprintBits(), 14);
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(narrow.addFile(path));
+        ASSERT_TRUE(wide.addFile(path));
+    }
+    ASSERT_LT(wide.estimatedFpr(), narrow.estimatedFpr());
+}
+
+TEST(TESTHTFuseFileVersioning, freeze_works) {
+    const unsigned total = 100000;
+    const unsigned probes = 100000;
+    char path[64];
+
+    HTFuseFileVersioning ffv;
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ffv.addFile(path);
+    }
+    // Duplicates are dropped by freeze
+    ffv.addFile("/data/set/0.parquet");
+    ASSERT_ANY_THROW(ffv.checkFile("/data/set/0.parquet"));
+    ASSERT_ANY_THROW(ffv.getHTable());
+
+    ffv.freeze();
+    ASSERT_TRUE(ffv.isFrozen());
+    ASSERT_EQ(ffv.getItems(), total);
+    ASSERT_LT(double(ffv.getHTableBitsLen())/total, 10.0);
+    ASSERT_ANY_THROW(ffv.addFile("/data/set/new.parquet"));
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(ffv.checkFile(path));
+    }
+
+    unsigned errors = 0;
+    for (unsigned a=0; a<probes; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.csv", a);
+        if (ffv.checkFile(path))
+            errors++;
+    }
+    ASSERT_NEAR(double(errors)/probes, 1.0/256, 0.001);
+
+    HTFuseFileVersioning copy;
+    copy.setHTable(ffv.getHTable());
+    ASSERT_TRUE(copy.isFrozen());
+    ASSERT_EQ(copy.getItems(), ffv.getItems());
+    ASSERT_EQ(copy.getHTableBytesLen(), ffv.getHTableBytesLen());
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(copy.checkFile(path));
+    }
+
+    HTFileVersioning plain;
+    ASSERT_ANY_THROW(plain.setHTable(ffv.getHTable()));
+    ASSERT_ANY_THROW(copy.setHTable(plain.getHTable()));
+}
+
+TEST(TESTHTFuseFileVersioning, small_sets_freeze) {
+    char path[64];
+
+    for (unsigned total=0; total<50; total++) {
+        HTFuseFileVersioning ffv;
+
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/small/%u", a);
+            ffv.addFile(path);
+        }
+        // Duplicates count until freeze drops them
+        if (total) {
+            ffv.addFile("/small/0");
+            ASSERT_EQ(ffv.getItems(), total+1);
+        }
+        ffv.freeze();
+        ASSERT_EQ(ffv.getItems(), total);
+
+        HTFuseFileVersioning copy;
+        copy.setHTable(ffv.getHTable());
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/small/%u", a);
+            ASSERT_TRUE(copy.checkFile(path));
+        }
+        if (!total)
+            ASSERT_FALSE(copy.checkFile("/small/0"));
+
+        copy.reset();
+        ASSERT_FALSE(copy.isFrozen());
+        ASSERT_EQ(copy.getItems(), 0u);
+    }
+}
+
+TEST(TESTHTExactFileVersioning, no_false_positives) {
+    const unsigned total = 20000;
+    char path[64];
+
+    HTExactFileVersioning efv;
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        efv.addFile(path);
+        efv.addFile(path);
+    }
+    ASSERT_EQ(efv.getItems(), total);
+    ASSERT_LE(efv.getItems(), efv.getSlots()/8*7);
+
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        ASSERT_TRUE(efv.checkFile(path));
+        snprintf(path, sizeof(path), "/data/set/%u.csv", a);
+        ASSERT_FALSE(efv.checkFile(path));
+    }
+
+    HTExactFileVersioning copy(10);
+    copy.setHTable(efv.getHTable());
+    ASSERT_EQ(copy.getItems(), total);
+    ASSERT_EQ(copy.getHTable(), efv.getHTable());
+
+    HTExactFileVersioning other;
+    for (unsigned a=0; a<100; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.csv", a);
+        other.addFile(path);
+    }
+    copy.mergeHTable(other);
+    efv.mergeHTable(other.getHTable());
+    ASSERT_EQ(copy.getItems(), total+100);
+    ASSERT_EQ(copy.getHTable(), efv.getHTable());
+    ASSERT_TRUE(efv.checkFile("/data/set/99.csv"));
+    ASSERT_FALSE(efv.checkFile("/data/set/100.csv"));
+
+    HTFileVersioning plain;
+    ASSERT_ANY_THROW(plain.setHTable(efv.getHTable()));
+    ASSERT_ANY_THROW(efv.setHTable(plain.getHTable()));
+
+    other.reset();
+    ASSERT_EQ(other.getItems(), 0u);
+    ASSERT_FALSE(other.checkFile("/data/set/0.csv"));
+    HTExactFileVersioning empty;
+    empty.setHTable(other.getHTable());
+    ASSERT_EQ(empty.getItems(), 0u);
+}
+
+TEST(TESTHTExactFileVersioning, refuses_short_payloads) {
+    // Payloads shorter than the key count, cut in a key, or whose count
+    // wraps around the size check
+    uint8_t payload[16] = {0};
+    size_t lens[] = {1, 7, 12, 16};
+    HTExactFileVersioning efv;
+    for (int a=0; a<4; a++) {
+        std::string str = HTFileVersioning::encodeHTable(payload, lens[a], 1,
+            lens[a]*8, HTFileVersioning::LAYOUT_FLAT,
+            HTFileVersioning::kindExact);
+        ASSERT_THROW(efv.setHTable(str), const char*);
+        ASSERT_THROW(efv.mergeHTable(str), const char*);
+    }
+    payload[7] = 0x20;
+    std::string wraps = HTFileVersioning::encodeHTable(payload, 8, 1, 64,
+        HTFileVersioning::LAYOUT_FLAT, HTFileVersioning::kindExact);
+    ASSERT_THROW(efv.setHTable(wraps), const char*);
+    ASSERT_EQ(efv.getItems(), 0u);
+}
+
+TEST(TESTHTFileVersioning, fingerprints_resolve_hits) {
+    const unsigned total = 20000;
+    const unsigned probes = 50000;
+    char path[64];
+
+    // A small table, most misses pass the bits
+    HTFileVersioning fv(total, 0.2), plain(total, 0.2);
+    fv.setFingerprints(true);
+    ASSERT_TRUE(fv.hasFingerprints());
+    ASSERT_ANY_THROW(fv.setConcurrent(true));
+
+    std::vector<std::string> names;
+    std::vector<const char*> fnames;
+    for (unsigned a=0; a<total; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.parquet", a);
+        names.push_back(path);
+    }
+    for (unsigned a=0; a<total; a++)
+        fnames.push_back(names[a].c_str());
+    fv.addFiles(&fnames[0], total/2);
+    for (unsigned a=total/2; a<total; a++)
+        fv.addFile(fnames[a]);
+    plain.addFiles(&fnames[0], total);
+    ASSERT_EQ(fv.getFingerprintsBytesLen(), total*sizeof(uint32_t));
+    ASSERT_EQ(fv.getHTable(), plain.getHTable());
+
+    for (unsigned a=0; a<total; a++)
+        ASSERT_TRUE(fv.checkFile(fnames[a]));
+
+    unsigned errors = 0, plain_errors = 0;
+    for (unsigned a=0; a<probes; a++) {
+        snprintf(path, sizeof(path), "/data/set/%u.csv", a);
+        errors += fv.checkFile(path);
+        plain_errors += plain.checkFile(path);
+    }
+    ASSERT_GT(plain_errors, probes/10);
+    ASSERT_LE(errors, 2u);
+
+    // Union of fingerprinted tables keeps them
+    HTFileVersioning other(total, 0.2);
+    other.setFingerprints(true);
+    other.addFile("/data/set/extra.csv");
+    const HTFileVersioning *pother = &other;
+    fv.mergeHTables(&pother, 1);
+    ASSERT_TRUE(fv.hasFingerprints());
+    ASSERT_TRUE(fv.checkFile("/data/set/extra.csv"));
+    ASSERT_TRUE(fv.checkFile(fnames[0]));
+
+    // Tables from outside drop them
+    fv.mergeHTable(plain.getHTable());
+    ASSERT_FALSE(fv.hasFingerprints());
+    ASSERT_EQ(fv.getFingerprintsBytesLen(), 0u);
+    ASSERT_ANY_THROW(fv.setFingerprints(true));
+    fv.reset();
+    fv.setFingerprints(true);
+    ASSERT_TRUE(fv.hasFingerprints());
+}
+
+TEST(TESTHTFileVersioning, hash_families_work) {
+    const unsigned total = 4000;
+    char path[64];
+
+    // CRC32C check value, without the final inversion
+    ASSERT_EQ(uint32_t(HTKernels::crc32cPair((const uint8_t*)"123456789", 9)),
+        ~uint32_t(0xE3069283));
+
+    // Short paths get two different CRCs, no two paths the same pair
+    const char *shorts[] = {"", "/", "/a", "/b", "/ab", "/ba", "/bin", "/etc",
+        "/usr/x", "/var/db", "/srv/app", "/srv/apq", "/srv/app/"};
+    std::set<uint64_t> pairs;
+    for (int a=0; a<13; a++) {
+        uint64_t pair = HTKernels::crc32cPair((const uint8_t*)shorts[a],
+            strlen(shorts[a]));
+        ASSERT_NE(uint32_t(pair), uint32_t(pair>>32));
+        pairs.insert(pair);
+    }
+    ASSERT_EQ(pairs.size(), 13u);
+
+    HTFileVersioning::HashFamily families[] = {
+        HTFileVersioning::HASH_ONE_AT_TIME,
+        HTFileVersioning::HASH_CRC32C,
+        HTFileVersioning::HASH_WYHASH
+    };
+    std::string exported[3];
+
+    for (int f=0; f<3; f++) {
+        HTFileVersioning fv(total, 0.01);
+        fv.setHashFamily(families[f]);
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/srv/app/releases/2024/%u/bin", a);
+            fv.addFile(path);
+        }
+        for (unsigned a=0; a<total; a++) {
+            snprintf(path, sizeof(path), "/srv/app/releases/2024/%u/bin", a);
+            ASSERT_TRUE(fv.checkFile(path));
+        }
+        unsigned fp = 0;
+        for (unsigned a=0; a<total*5; a++) {
+            snprintf(path, sizeof(path), "/srv/app/releases/2023/%u/bin", a);
+            fp += fv.checkFile(path);
+        }
+        ASSERT_LT(double(fp)/(total*5), 0.02);
+        ASSERT_ANY_THROW(fv.setHashFamily(families[(f+1)%3]));
+
+        exported[f] = fv.getHTable();
+        HTFileVersioning loaded;
+        loaded.setHTable(exported[f]);
+        ASSERT_EQ(loaded.getHashFamily(), families[f]);
+        ASSERT_TRUE(loaded.checkFile("/srv/app/releases/2024/7/bin"));
+    }
+
+    // Same geometry, other family: no mixing
+    HTFileVersioning crc(total, 0.01);
+    crc.setHashFamily(HTFileVersioning::HASH_CRC32C);
+    ASSERT_THROW(crc.mergeHTable(exported[2]), const char*);
+    crc.mergeHTable(exported[1]);
+    ASSERT_TRUE(crc.checkFile("/srv/app/releases/2024/7/bin"));
+
+    // Legacy geometry gets a header once the family is not the default
+    HTFileVersioning legacy, back;
+    legacy.setHashFamily(HTFileVersioning::HASH_WYHASH);
+    legacy.addFile("/etc/hosts");
+    back.setHTable(legacy.getHTable());
+    ASSERT_EQ(back.getHashFamily(), HTFileVersioning::HASH_WYHASH);
+    ASSERT_TRUE(back.checkFile("/etc/hosts"));
+}
+
+TEST(TESTHTFileVersioning, wide_index_reaches_all_bits) {
+    // The legacy derivation never reaches 15 of the 256 words
+    HTFileVersioning legacy, wide(HTFileVersioning::legacyBitsLen);
+    ASSERT_EQ(legacy.getIndex(), HTFileVersioning::INDEX_NIBBLES);
+    ASSERT_EQ(wide.getIndex(), HTFileVersioning::INDEX_WIDE);
+    ASSERT_EQ(wide.getHTableBitsLen(), legacy.getHTableBitsLen());
+
+    char path[64];
+    for (unsigned a=0; a<200000; a++) {
+        snprintf(path, sizeof(path), "/var/lib/pkg/%u", a);
+        legacy.addFile(path);
+        wide.addFile(path);
+    }
+    ASSERT_LT(legacy.popcount(), HTFileVersioning::legacyBitsLen);
+    ASSERT_EQ(wide.popcount(), HTFileVersioning::legacyBitsLen);
+
+    // Positions of big tables take the high bits of the products
+    HTFileVersioning big(uint64_t(1)<<28);
+    big.addFile("/etc/hosts");
+    ASSERT_TRUE(big.checkFile("/etc/hosts"));
+    ASSERT_FALSE(big.checkFile("/etc/passwd"));
+
+    // Derivations never mix
+    std::string exported = wide.getHTable();
+    ASSERT_THROW(legacy.mergeHTable(exported), const char*);
+    legacy.setHTable(exported);
+    ASSERT_EQ(legacy.getIndex(), HTFileVersioning::INDEX_WIDE);
+    ASSERT_TRUE(legacy.checkFile("/var/lib/pkg/7"));
+}
+
+/// Decodes an exported table to its blob.
+static std::vector<uint8_t> exportedBlob(const std::string &str)
+{
+    HT_B64 b64;
+    size_t len = str.size()/4*3;
+    std::vector<uint8_t> blob(len);
+    b64.base64_decode((const unsigned char*)str.c_str(), str.size(), &len,
+        &blob[0]);
+    blob.resize(len);
+    return blob;
+}
+
+/// Encodes a blob, refreshing its checksum first when asked.
+static std::string exportBlob(std::vector<uint8_t> blob, bool crc)
+{
+    if (crc) {
+        uint32_t c = HTKernels::crc32c(&blob[0], 16);
+        c = HTKernels::crc32c(&blob[20], blob.size()-20, c);
+        for (int b=0; b<4; ++b)
+            blob[16+b] = uint8_t(c>>(b*8));
+    }
+    HT_B64 b64;
+    size_t len;
+    unsigned char *out = b64.base64_encode(&blob[0], blob.size(), &len);
+    std::string ret((const char*)out, len);
+    delete[] out;
+    return ret;
+}
+
+TEST(TESTHTFileVersioning, header_rejects_bad_blobs) {
+    ASSERT_EQ(HTKernels::crc32c((const uint8_t*)"123456789", 9), 0xE3069283);
+    ASSERT_EQ(HTKernels::crc32c((const uint8_t*)"56789", 5,
+        HTKernels::crc32c((const uint8_t*)"1234", 4)), 0xE3069283);
+
+    HTFileVersioning fv(1000, 0.01);
+    fv.addFile("/etc/hosts");
+    std::vector<uint8_t> blob = exportedBlob(fv.getHTable());
+    ASSERT_EQ(blob[0], 'H');
+    ASSERT_EQ(blob[1], 2);
+    ASSERT_EQ(blob[15], HTDataCompress::CODEC_RICE);
+
+    HTFileVersioning back;
+    back.setHTable(exportBlob(blob, false));
+    ASSERT_TRUE(back.checkFile("/etc/hosts"));
+
+    // Any flipped bit is caught by the checksum
+    for (size_t a=0; a<blob.size(); a+=7) {
+        if (a >= 16 && a < 20)
+            continue;
+        std::vector<uint8_t> bad(blob);
+        bad[a] ^= 0x10;
+        ASSERT_THROW(back.setHTable(exportBlob(bad, false)), const char*);
+    }
+    ASSERT_TRUE(back.checkFile("/etc/hosts"));
+
+    // Codecs from the future are refused
+    std::vector<uint8_t> future(blob);
+    future[15] = 0x7F;
+    ASSERT_THROW(back.setHTable(exportBlob(future, true)), const char*);
+
+    // So are other header versions, even with a valid checksum
+    std::vector<uint8_t> version(blob);
+    version[1] = 3;
+    ASSERT_THROW(back.setHTable(exportBlob(version, true)), const char*);
+
+    // Fixed width codes load when the header records them
+    std::vector<uint8_t> raw(fv.getHTableBytesLen());
+    fv.getRawHTable(&raw[0], raw.size());
+    std::vector<uint8_t> fixed(blob.begin(), blob.begin()+20);
+    fixed[15] = HTDataCompress::CODEC_LZW;
+    uint8_t *payload = NULL;
+    size_t len;
+    HTDataCompress::compress(&raw[0], raw.size(), &payload, &len);
+    fixed.insert(fixed.end(), payload, payload+len);
+    delete[] payload;
+    HTFileVersioning fixedBack;
+    fixedBack.setHTable(exportBlob(fixed, true));
+    ASSERT_TRUE(fixedBack.checkFile("/etc/hosts"));
+
+    // Mismatches are rejected before the payload is touched: a broken
+    // payload under a valid header reports the geometry, not the payload
+    std::vector<uint8_t> broken(blob.begin(), blob.begin()+20);
+    broken.push_back(9);
+    for (int a=0; a<64; ++a)
+        broken.push_back(0xFF);
+    HTFileVersioning other(2000, 0.01);
+    try {
+        other.mergeHTable(exportBlob(broken, true));
+        FAIL();
+    } catch (const char *e) {
+        ASSERT_STREQ(e, "Table geometry mismatch");
+    }
+    HTCountingFileVersioning counting;
+    try {
+        counting.mergeHTable(exportBlob(broken, true));
+        FAIL();
+    } catch (const char *e) {
+        ASSERT_STREQ(e, "Not a counting table");
+    }
+    ASSERT_THROW(back.mergeHTable(exportBlob(broken, true)), const char*);
+}
+
+TEST(TESTHTFileVersioning, rice_merges_sparse_deltas) {
+    // A 3% fill: Rice coded gaps stay close to the entropy (about 0.2
+    // bits per bit) and well under the other codecs
+    const size_t il = 1<<19;
+    std::vector<uint8_t> in(il), back(il);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t a=0; a<il*8; a++) {
+        x ^= x<<13; x ^= x>>7; x ^= x<<17;
+        if (x%32 == 0)
+            in[a>>3] |= uint8_t(1) << (a&7);
+    }
+    HTDataCompress::Codec codecs[] = {HTDataCompress::CODEC_RICE,
+        HTDataCompress::CODEC_SPARSE, HTDataCompress::CODEC_LZW_VAR};
+    size_t sizes[3];
+    for (int c=0; c<3; c++) {
+        uint8_t *o = NULL;
+        HTDataCompress::compress(&in[0], il, &o, &sizes[c], codecs[c]);
+        HTDataCompress::decompress(o, sizes[c], &back[0], il, codecs[c]);
+        ASSERT_TRUE(in == back);
+        delete[] o;
+    }
+    ASSERT_LT(sizes[0], il*8*21/100/8);
+    ASSERT_LT(sizes[0]*10, sizes[1]*9);
+    ASSERT_LT(sizes[0]*10, sizes[2]*9);
+
+    // Merges set the listed bits, and nothing else
+    HTFileVersioning fv(1000, 0.01), other(1000, 0.01);
+    fv.addFile("/etc/hosts");
+    other.addFile("/etc/passwd");
+    std::string delta = fv.getHTable();
+    std::vector<uint8_t> blob = exportedBlob(delta);
+    ASSERT_EQ(blob[15], HTDataCompress::CODEC_RICE);
+    other.mergeHTable(delta);
+    ASSERT_TRUE(other.checkFile("/etc/hosts"));
+    ASSERT_TRUE(other.checkFile("/etc/passwd"));
+    ASSERT_FALSE(other.checkFile("/etc/group"));
+
+    // A truncated payload is refused before the table is touched
+    HTFileVersioning empty(1000, 0.01);
+    std::string before = empty.getHTable();
+    blob.pop_back();
+    ASSERT_THROW(empty.mergeHTable(exportBlob(blob, true)), const char*);
+    ASSERT_EQ(empty.getHTable(), before);
+}
+
+TEST(TESTHTFileVersioning, listed_bits_stay_in_the_table) {
+    // 1001 bits: the last byte ends with 7 bits of padding, which a
+    // listed position must not reach
+    HTFileVersioning fv(1001);
+    std::vector<uint8_t> blob = exportedBlob(fv.getHTable());
+    std::vector<uint8_t> raw(126);
+    HTDataCompress::Codec codecs[] = {HTDataCompress::CODEC_SPARSE,
+        HTDataCompress::CODEC_RICE};
+    for (int c=0; c<2; c++) {
+        for (uint64_t pos=1000; pos<=1001; pos++) {
+            bzero(&raw[0], raw.size());
+            raw[pos>>3] |= uint8_t(1) << (pos&7);
+            uint8_t *payload = NULL;
+            size_t len;
+            HTDataCompress::compress(&raw[0], raw.size(), &payload, &len,
+                codecs[c]);
+            std::vector<uint8_t> listed(blob.begin(), blob.begin()+20);
+            listed[15] = codecs[c];
+            listed.insert(listed.end(), payload, payload+len);
+            delete[] payload;
+            std::string str = exportBlob(listed, true);
+
+            HTFileVersioning merged(1001), set;
+            if (pos < 1001) {
+                merged.mergeHTable(str);
+                set.setHTable(str);
+                ASSERT_EQ(merged.popcount(), 1u);
+                ASSERT_EQ(set.popcount(), 1u);
+                ASSERT_EQ(set.getHTable(), merged.getHTable());
+                continue;
+            }
+            std::string before = merged.getHTable();
+            ASSERT_THROW(merged.mergeHTable(str), const char*);
+            ASSERT_EQ(merged.getHTable(), before);
+            ASSERT_THROW(set.setHTable(str), const char*);
+            ASSERT_EQ(set.getHTableBitsLen(), 4096u);
+        }
+    }
+}